@@ -3,21 +3,33 @@
 #include <stdint.h>
 #include <stdarg.h>
 #include <string.h>
-#include <wchar.h>
 #include <wctype.h>
+#include <ctype.h>
 #include <locale.h>
 #include <errno.h>
 #include <time.h>
+#include <math.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
 
 #ifdef _WIN32
-/* for GetACP() */
+/* for GetACP(), GetSystemInfo() and file mapping */
+#include <windows.h>
 #include <winnls.h>
+#else
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <langinfo.h>
 #endif
 
 #include <iconv.h>
 #include <zlib.h>
+#ifdef USE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
 
 
 /************* Dynamically allocated data buffer ****************/
@@ -83,13 +95,6 @@ void append_buffer_char(buffer_t * buf, const char ch)
 	buf->size += sizeof(ch);
 }
 
-void append_buffer_wchar(buffer_t * buf, const wchar_t ch)
-{
-	expand_buffer(buf, buf->size+sizeof(ch));
-	*((wchar_t*)(buf->data+buf->size)) = ch;
-	buf->size += sizeof(ch);
-}
-
 void copy_buffer(buffer_t * dest_buf, buffer_t * src_buf)
 {
 	if (!src_buf || !dest_buf || is_buffer_new(src_buf))
@@ -138,6 +143,43 @@ typedef struct {
 	buffer_t value_buf;
 } gsf_tag_t;
 
+/* shared between the script and the jobs of a gsflib made by this run */
+typedef struct gsflib_state_t gsflib_state_t;
+struct gsflib_state_t {
+	int done;
+	int failed;
+	buffer_t dependent_buf;  /* paths (char *) of minigsfs written before the gsflib was done */
+	
+	/* the uncompressed program, kept while the script can still diff
+		against it. freed when the last reference is released */
+	buffer_t program_buf;
+	unsigned program_refs;
+	
+	/* the MusicPlayer2000 song table of the program, searched for once */
+	int song_table_searched;
+	size_t song_table;
+	
+	/* with BlankUnusedSongs, the gsflib is only compressed at the end of
+		the script, once the song IDs of all its minigsfs are known */
+	void * pending_job;
+	unsigned pending_report_size;
+	unsigned blank_margin;
+	buffer_t used_id_buf;  /* unsigned */
+	
+	gsflib_state_t * next;
+};
+
+typedef struct {
+	buffer_t name_buf;
+	unsigned entry_point;
+	gsflib_state_t * state;
+} gsflib_t;
+
+typedef struct {
+	size_t start;
+	size_t end;
+} diff_span_t;
+
 
 
 
@@ -145,21 +187,46 @@ typedef struct {
 /******************** Global variables **************************/
 
 FILE * script_file = NULL;
-wchar_t * script_name = NULL;
-unsigned script_line = 0;
+char * script_dir = NULL;
+/* thread-local so that worker threads can report errors against the
+	script line that queued their job */
+_Thread_local char * script_name = NULL;
+_Thread_local unsigned script_line = 0;
 
 unsigned entry_point = 0x8000000;
-buffer_t filename_template_buf = DEFAULT_BUFFER_T;
+buffer_t filename_op_buf = DEFAULT_BUFFER_T;  /* filename_op_t, the compiled filename template */
+buffer_t filename_literal_buf = DEFAULT_BUFFER_T;
+int filename_template_error = 0;
 unsigned minigsf_offset = 0;
+unsigned trim_rom_alignment = 0;  /* 0 = don't trim */
+int use_chunk_cache = 0;
+int retag_mode = 0;  /* only replace the tags of existing files */
+int verify_mode = 0;
+int recompress_mode = 0;
+unsigned shard_index = 0;  /* --shard K/N, 0-based */
+unsigned shard_count = 1;
+size_t shard_output_index = 0;
+unsigned report_region_size = 0;  /* 0 = no report */
+unsigned blank_song_margin = 0;  /* 0 = don't blank */
+unsigned auto_length_loops = 0;  /* 0 = use the length and fade tags */
+unsigned auto_length_fade = 10;
+int probe_songs = 0;
 unsigned song_number = 1;
 unsigned song_id;
 buffer_t gsf_tag_buf = DEFAULT_BUFFER_T;
+buffer_t gsflib_buf = DEFAULT_BUFFER_T;
+gsflib_state_t * active_gsflib_state = NULL;
+gsflib_state_t * active_overlay_state = NULL;
+unsigned overlay_lib_count = 0;  /* the files of the active overlay, from _lib2 on */
+buffer_t overlay_span_buf = DEFAULT_BUFFER_T;  /* diff_span_t, the addresses they cover */
+gsflib_state_t * gsflib_state_list = NULL;
 
 #ifdef _WIN32
 char os_character_encoding[16];
 #else
 #define os_character_encoding ""
 #endif
+int os_encoding_is_utf8 = 1;  /* filenames and output need no conversion */
 
 
 
@@ -168,22 +235,112 @@ char os_character_encoding[16];
 
 /******************** Utility ******************************/
 
-int wcscasecmp(const wchar_t * ws1, const wchar_t * ws2)
+/* strings are kept as UTF-8, and only decoded where the characters
+	themselves matter. returns the length of the character at s, or 0 if it
+	isn't valid UTF-8 */
+size_t decode_utf8(const char * s, size_t size, unsigned * out)
+{
+	static const unsigned min_value[4] = {0, 0x80, 0x800, 0x10000};
+	if (!size)
+		return 0;
+	unsigned ch = (uint8_t)s[0];
+	size_t extra = ch >= 0xf0 ? 3 : ch >= 0xe0 ? 2 : ch >= 0xc0 ? 1 : 0;
+	if (ch >= 0x80 && (!extra || ch >= 0xf8))
+		return 0;
+	if (extra >= size)
+		return 0;
+	if (extra)
+		ch &= 0x3f >> extra;
+	for (size_t i = 1; i <= extra; i++)
+	{
+		if ((s[i] & 0xc0) != 0x80)
+			return 0;
+		ch = (ch << 6) | (s[i] & 0x3f);
+	}
+	if (ch < min_value[extra] || ch > 0x10ffff || (ch >= 0xd800 && ch < 0xe000))
+		return 0;
+	*out = ch;
+	return extra+1;
+}
+
+/* returns the length written to out, which must have room for 4 bytes */
+size_t encode_utf8(char * out, unsigned ch)
+{
+	if (ch < 0x80)
+	{
+		out[0] = ch;
+		return 1;
+	}
+	size_t extra = ch < 0x800 ? 1 : ch < 0x10000 ? 2 : 3;
+	out[0] = (uint8_t)(0xff00 >> (extra+1)) | (ch >> (extra*6));
+	for (size_t i = 1; i <= extra; i++)
+		out[i] = 0x80 | ((ch >> ((extra-i)*6)) & 0x3f);
+	return extra+1;
+}
+
+/* returns the number of bytes from the start of s that are valid UTF-8 */
+size_t get_valid_utf8_size(const char * s, size_t size)
 {
 	size_t i = 0;
+	unsigned ch;
+	while (i < size)
+	{
+		if (!(s[i] & 0x80))
+			i++;
+		else
+		{
+			size_t length = decode_utf8(s+i, size-i, &ch);
+			if (!length)
+				break;
+			i += length;
+		}
+	}
+	return i;
+}
+
+/* returns the length of the UTF-8 character at s, which is 1 for a byte that
+	isn't valid */
+size_t get_utf8_char_size(const char * s)
+{
+	unsigned ch;
+	size_t length = decode_utf8(s, SIZE_MAX, &ch);
+	return length ? length : 1;
+}
+
+/* returns the length of the whitespace character at s, or 0 */
+size_t get_utf8_space_size(const char * s)
+{
+	unsigned ch = (uint8_t)*s;
+	size_t length = 1;
+	if (ch >= 0x80 && !(length = decode_utf8(s, SIZE_MAX, &ch)))
+		return 0;
+	return ch && iswspace(ch) ? length : 0;
+}
+
+/* case-insensitive comparison of UTF-8 strings */
+int utf8_casecmp(const char * s1, const char * s2)
+{
 	while (1)
 	{
-		wchar_t ch1 = towlower(ws1[i]);
-		wchar_t ch2 = towlower(ws2[i]);
+		unsigned ch1 = (uint8_t)*s1;
+		unsigned ch2 = (uint8_t)*s2;
+		size_t length1 = 1;
+		size_t length2 = 1;
+		if (ch1 >= 0x80 && !(length1 = decode_utf8(s1, SIZE_MAX, &ch1)))
+			length1 = 1;
+		if (ch2 >= 0x80 && !(length2 = decode_utf8(s2, SIZE_MAX, &ch2)))
+			length2 = 1;
+		ch1 = towlower(ch1);
+		ch2 = towlower(ch2);
 		if (ch1 != ch2) return ch1 - ch2;
-		if (ch1 == L'\0') return 0;
-		i++;
+		if (!ch1) return 0;
+		s1 += length1;
+		s2 += length2;
 	}
 }
 
 
 
-
 /******************* Multi-byte I/O ******************************/
 
 int fput32(unsigned v, FILE *f)
@@ -197,6 +354,16 @@ int fput32(unsigned v, FILE *f)
 	return ~EOF;
 }
 
+unsigned read16(uint8_t *p)
+{
+	return p[0] | (p[1]<<8);
+}
+
+unsigned read32(uint8_t *p)
+{
+	return p[0] | (p[1]<<8) | (p[2]<<16) | ((unsigned)p[3]<<24);
+}
+
 void write32(uint8_t *p, unsigned v)
 {
 	p[0] = v;
@@ -212,59 +379,101 @@ void write32(uint8_t *p, unsigned v)
 
 /********************* Error reporting *****************************/
 
-void msg_prologue()
-{
-	if (script_name)
-		wprintf(L"%ls:",script_name);
-	if (script_line)
-		printf("%u:",script_line);
-	
-	if (script_name || script_line)
-		putchar(' ');
-}
+/* messages can come from worker threads, so each one is printed as a whole
+	under a lock. messages are UTF-8, and are only converted if the OS uses
+	another encoding */
+pthread_mutex_t msg_mutex = PTHREAD_MUTEX_INITIALIZER;
+unsigned error_count = 0;
 
-void warn(char * msg, ...)
+/* text that can't be converted is printed as it is, since it can be a path
+	that's already in the OS encoding */
+void print_msg_text(char * text)
 {
-	msg_prologue();
-	
-	va_list args;
-	va_start(args,msg);
-	vprintf(msg,args);
-	va_end(args);
-	putchar('\n');
+	if (!os_encoding_is_utf8)
+	{
+		iconv_t ic = iconv_open(os_character_encoding,"UTF-8");
+		if (ic != (iconv_t)-1)
+		{
+			/* no encoding takes more than 4 bytes for a UTF-8 byte */
+			size_t src_left = strlen(text);
+			size_t out_size = src_left*4 + 1;
+			char * out = malloc(out_size);
+			char * src_ptr = text;
+			char * dest_ptr = out;
+			size_t dest_left = out_size-1;
+			size_t status = out ? iconv(ic,(char**)&src_ptr,&src_left,(char**)&dest_ptr,&dest_left) : (size_t)-1;
+			iconv_close(ic);
+			if (status != (size_t)-1)
+			{
+				*dest_ptr = '\0';
+				fputs(out,stdout);
+				free(out);
+				return;
+			}
+			free(out);
+		}
+	}
+	fputs(text,stdout);
 }
 
-void err(char * msg, ...)
+/* messages like the gsflib report's map can be long, so the text is sized
+	to fit, with the short fixed buffer kept for when that can't be had */
+void vmsg(int is_error, char * msg, va_list args)
 {
-	msg_prologue();
+	char prefix[0x120];
+	size_t length = 0;
+	if (script_name)
+		length += snprintf(prefix, sizeof(prefix), "%.*s:", 0x100, script_name);
+	if (script_line)
+		length += snprintf(prefix+length, sizeof(prefix)-length, "%u:", script_line);
+	if (script_name || script_line)
+		prefix[length++] = ' ';
+	prefix[length] = '\0';
 	
-	va_list args;
-	va_start(args,msg);
-	vprintf(msg,args);
-	va_end(args);
+	va_list size_args;
+	va_copy(size_args, args);
+	int msg_length = vsnprintf(NULL,0,msg,size_args);
+	va_end(size_args);
+	
+	char short_text[0x400];
+	char * text = short_text;
+	size_t text_size = sizeof(short_text);
+	if (msg_length >= 0 && length + msg_length + 1 > text_size)
+	{
+		char * long_text = malloc(length + msg_length + 1);
+		if (long_text)
+		{
+			text = long_text;
+			text_size = length + msg_length + 1;
+		}
+	}
+	snprintf(text,text_size,"%s",prefix);
+	vsnprintf(text+length,text_size-length,msg,args);
+	
+	pthread_mutex_lock(&msg_mutex);
+	error_count += is_error;
+	print_msg_text(text);
 	putchar('\n');
+	pthread_mutex_unlock(&msg_mutex);
+	
+	if (text != short_text)
+		free(text);
 }
 
-void wwarn(wchar_t * msg, ...)
+void warn(char * msg, ...)
 {
-	msg_prologue();
-	
 	va_list args;
 	va_start(args,msg);
-	vwprintf(msg,args);
+	vmsg(0,msg,args);
 	va_end(args);
-	putchar('\n');
 }
 
-void werr(wchar_t * msg, ...)
+void err(char * msg, ...)
 {
-	msg_prologue();
-	
 	va_list args;
 	va_start(args,msg);
-	vwprintf(msg,args);
+	vmsg(1,msg,args);
 	va_end(args);
-	putchar('\n');
 }
 
 
@@ -342,9 +551,287 @@ size_t iconv_2(const char * to, const char * from, buffer_t * dest_buf, void * s
 
 
 
+/************************ Thread pool ******************************/
+
+/* the expensive work (compressing and writing files) is queued as jobs and
+	run by a pool of worker threads, while the main thread keeps reading
+	scripts. a job type embeds job_t as its first member, and its run function
+	must free everything it owns except the job itself. */
+typedef struct job_t job_t;
+struct job_t {
+	void (*run)(job_t * job);
+	job_t * next;
+	size_t memory;  /* reserved from the memory budget until it's done */
+	
+	/* for error reporting */
+	char * script_name;
+	unsigned script_line;
+};
+
+pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t pool_job_cond = PTHREAD_COND_INITIALIZER;
+pthread_cond_t pool_idle_cond = PTHREAD_COND_INITIALIZER;
+job_t * pool_head = NULL;
+job_t * pool_tail = NULL;
+unsigned pool_pending = 0;  /* queued + running */
+int pool_quit = 0;
+pthread_t * pool_threads = NULL;
+unsigned pool_thread_count = 0;
+
+/* with --max-memory, ROM loads and jobs reserve what they are expected to
+	hold from a budget before they start. only the script's thread waits for
+	memory to be released, and it's let through when no job is left to
+	release any, so something bigger than the whole budget still runs, alone */
+pthread_cond_t memory_cond = PTHREAD_COND_INITIALIZER;
+size_t max_memory = 0;  /* 0 for no budget */
+size_t memory_reserved = 0;
+size_t memory_reserved_peak = 0;
+
+void reserve_memory(size_t size)
+{
+	if (!max_memory)
+		return;
+	
+	pthread_mutex_lock(&pool_mutex);
+	while (memory_reserved + size > max_memory && pool_pending)
+		pthread_cond_wait(&memory_cond, &pool_mutex);
+	memory_reserved += size;
+	if (memory_reserved > memory_reserved_peak)
+		memory_reserved_peak = memory_reserved;
+	pthread_mutex_unlock(&pool_mutex);
+}
+
+void release_memory(size_t size)
+{
+	if (!max_memory)
+		return;
+	
+	pthread_mutex_lock(&pool_mutex);
+	memory_reserved -= size;
+	pthread_cond_broadcast(&memory_cond);
+	pthread_mutex_unlock(&pool_mutex);
+}
+
+/* the most memory the process had resident, or 0 if it can't be told */
+size_t get_peak_resident_memory()
+{
+#ifdef _WIN32
+	return 0;
+#else
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage))
+		return 0;
+#ifdef __APPLE__
+	return usage.ru_maxrss;
+#else
+	return (size_t)usage.ru_maxrss * 1024;
+#endif
+#endif
+}
+
+unsigned get_cpu_count()
+{
+#ifdef _WIN32
+	SYSTEM_INFO si;
+	GetSystemInfo(&si);
+	return si.dwNumberOfProcessors;
+#else
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+	return count > 0 ? count : 1;
+#endif
+}
+
+void run_job(job_t * job)
+{
+	script_name = job->script_name;
+	script_line = job->script_line;
+	job->run(job);
+	script_name = NULL;
+	script_line = 0;
+	release_memory(job->memory);
+	free(job->script_name);
+	free(job);
+}
+
+void * pool_worker(void * arg)
+{
+	(void)arg;
+	
+	pthread_mutex_lock(&pool_mutex);
+	while (1)
+	{
+		while (!pool_head && !pool_quit)
+			pthread_cond_wait(&pool_job_cond, &pool_mutex);
+		if (!pool_head)
+			break;
+		
+		job_t * job = pool_head;
+		pool_head = job->next;
+		if (!pool_head)
+			pool_tail = NULL;
+		pthread_mutex_unlock(&pool_mutex);
+		
+		run_job(job);
+		
+		pthread_mutex_lock(&pool_mutex);
+		if (!--pool_pending)
+		{
+			pthread_cond_broadcast(&pool_idle_cond);
+			pthread_cond_broadcast(&memory_cond);
+		}
+	}
+	pthread_mutex_unlock(&pool_mutex);
+	
+	return NULL;
+}
+
+void start_pool(unsigned thread_count)
+{
+	if (!thread_count)
+		thread_count = get_cpu_count();
+	
+	pool_threads = malloc(thread_count * sizeof(*pool_threads));
+	for (pool_thread_count = 0; pool_thread_count < thread_count; pool_thread_count++)
+	{
+		if (pthread_create(&pool_threads[pool_thread_count], NULL, pool_worker, NULL))
+		{
+			warn("Can't create worker thread, using %u",pool_thread_count);
+			break;
+		}
+	}
+}
+
+/* queues a job, once the memory it's expected to use can be reserved.
+	with no worker threads, the job is run immediately */
+void submit_job(job_t * job, void (*run)(job_t *), size_t memory)
+{
+	job->run = run;
+	job->next = NULL;
+	job->memory = memory;
+	job->script_name = script_name ? strdup(script_name) : NULL;
+	job->script_line = script_line;
+	reserve_memory(memory);
+	
+	if (!pool_thread_count)
+	{
+		char * old_name = script_name;
+		unsigned old_line = script_line;
+		run_job(job);
+		script_name = old_name;
+		script_line = old_line;
+		return;
+	}
+	
+	pthread_mutex_lock(&pool_mutex);
+	if (pool_tail)
+		pool_tail->next = job;
+	else
+		pool_head = job;
+	pool_tail = job;
+	pool_pending++;
+	pthread_cond_signal(&pool_job_cond);
+	pthread_mutex_unlock(&pool_mutex);
+}
+
+void wait_pool()
+{
+	pthread_mutex_lock(&pool_mutex);
+	while (pool_pending)
+		pthread_cond_wait(&pool_idle_cond, &pool_mutex);
+	pthread_mutex_unlock(&pool_mutex);
+}
+
+void stop_pool()
+{
+	wait_pool();
+	
+	pthread_mutex_lock(&pool_mutex);
+	pool_quit = 1;
+	pthread_cond_broadcast(&pool_job_cond);
+	pthread_mutex_unlock(&pool_mutex);
+	
+	for (unsigned i = 0; i < pool_thread_count; i++)
+		pthread_join(pool_threads[i], NULL);
+	free(pool_threads);
+	pool_threads = NULL;
+	pool_thread_count = 0;
+}
+
+
+
+
+
+
+
+/********************** Mapped files ******************************/
+
+/* returns NULL on failure. an empty file maps to a non-NULL pointer */
+void * map_file(const char * path, size_t * size)
+{
+	static uint8_t empty;
+#ifdef _WIN32
+	HANDLE f = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+	if (f == INVALID_HANDLE_VALUE)
+		return NULL;
+	LARGE_INTEGER file_size;
+	void * data = NULL;
+	if (GetFileSizeEx(f, &file_size))
+	{
+		*size = file_size.QuadPart;
+		data = &empty;
+		if (*size)
+		{
+			HANDLE mapping = CreateFileMappingA(f, NULL, PAGE_READONLY, 0, 0, NULL);
+			data = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+			if (mapping)
+				CloseHandle(mapping);
+		}
+	}
+	CloseHandle(f);
+	return data;
+#else
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	struct stat st;
+	void * data = NULL;
+	if (!fstat(fd, &st))
+	{
+		*size = st.st_size;
+		data = &empty;
+		if (*size)
+		{
+			data = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (data == MAP_FAILED)
+				data = NULL;
+		}
+	}
+	close(fd);
+	return data;
+#endif
+}
+
+void unmap_file(void * data, size_t size)
+{
+	if (!size)
+		return;
+#ifdef _WIN32
+	UnmapViewOfFile(data);
+#else
+	munmap(data, size);
+#endif
+}
+
+
+
+
+
+
+
+
 /********************** Script I/O ******************************/
 
-FILE * open_script(char * src_filename)
+FILE * open_script(const char * src_filename)
 {
 	/* open */
 	script_file = fopen(src_filename,"r");
@@ -352,7 +839,7 @@ FILE * open_script(char * src_filename)
 	script_line = 0;
 	if (!script_file)
 	{
-		printf("Can't open %s: %s\n", src_filename, strerror(errno));
+		err("Can't open %s: %s", src_filename, strerror(errno));
 		script_file = NULL;
 		return NULL;
 	}
@@ -371,21 +858,23 @@ FILE * open_script(char * src_filename)
 		src_filename_size++;
 	}
 	
-	/* convert base filename to wchars for future printing */
+	/* convert base filename to UTF-8 for future printing */
 	static buffer_t filename_buf = DEFAULT_BUFFER_T;
 	filename_buf.size = 0;
-	if (iconv_2("wchar_t",os_character_encoding, &filename_buf, src_filename+base_name_index,src_filename_size-base_name_index+1))
+	if (os_encoding_is_utf8)
+		set_buffer(&filename_buf, src_filename+base_name_index, src_filename_size-base_name_index+1);
+	else if (!iconv_2("UTF-8",os_character_encoding, &filename_buf, (char*)src_filename+base_name_index,src_filename_size-base_name_index+1))
+		filename_buf.size = 0;
+	if (filename_buf.size)
 		script_name = filename_buf.data;
 	
-	/* if needed, chdir to location of script file */
-	if (base_name_index)
-	{
-		src_filename[base_name_index] = '\0';
-		if (chdir(src_filename))
-		{
-			printf("WARNING: Can't change directory to %s (%s), may fail\n",src_filename,strerror(errno));
-		}
-	}
+	/* files named by the script are relative to its directory. this is kept
+		as a prefix instead of a chdir, so several scripts can be processed
+		while the jobs of the previous ones are still running */
+	free(script_dir);
+	script_dir = malloc(base_name_index+1);
+	memcpy(script_dir, src_filename, base_name_index);
+	script_dir[base_name_index] = '\0';
 	
 	return script_file;
 }
@@ -393,7 +882,21 @@ FILE * open_script(char * src_filename)
 void close_script()
 {
 	fclose(script_file);
+	script_file = NULL;
 	script_name = NULL;
+	script_line = 0;
+}
+
+/* returns a newly allocated path of a filename relative to the script */
+char * get_script_path(const char * os_filename)
+{
+	size_t dir_len = script_dir ? strlen(script_dir) : 0;
+	size_t filename_len = strlen(os_filename);
+	char * path = malloc(dir_len+filename_len+1);
+	if (dir_len)
+		memcpy(path, script_dir, dir_len);
+	memcpy(path+dir_len, os_filename, filename_len+1);
+	return path;
 }
 
 
@@ -407,7 +910,7 @@ int script_feof()
 	return feof(script_file);
 }
 
-wchar_t * read_script_line()
+char * read_script_line()
 {
 	++script_line;
 	if (script_feof()) return NULL;
@@ -433,17 +936,18 @@ wchar_t * read_script_line()
 			break;
 		append_buffer_char(&src_buf, ch);
 	}
-	if (((char*)src_buf.data)[src_buf.size-1] == '\r')  /* remove CR from CRLF */
+	if (src_buf.size && ((char*)src_buf.data)[src_buf.size-1] == '\r')  /* remove CR from CRLF */
 		--(src_buf.size);
 	append_buffer_char(&src_buf, '\0');
 	
-	/* convert line to wchars */
-	static buffer_t out_buf = DEFAULT_BUFFER_T;
-	init_new_buffer(&out_buf,0x200);
-	out_buf.size = 0;
-	if (!iconv_2("wchar_t","UTF-8", &out_buf, src_buf.data,src_buf.size))
+	/* the line is used as it is, once it's known to be UTF-8 */
+	size_t valid_size = get_valid_utf8_size(src_buf.data, src_buf.size);
+	if (valid_size < src_buf.size)
+	{
+		err("Invalid character at index %zu",valid_size);
 		return NULL;
-	return out_buf.data;
+	}
+	return src_buf.data;
 }
 
 
@@ -470,9 +974,9 @@ const char * get_token_type_name(int type)
 }
 
 
-token_t * parse_one_token(wchar_t * line_start)
+token_t * parse_one_token(char * line_start)
 {
-	static wchar_t * line = NULL;
+	static char * line = NULL;
 	static size_t index = 0;
 	static token_t token;
 	
@@ -488,14 +992,16 @@ token_t * parse_one_token(wchar_t * line_start)
 		return NULL;
 	
 	/* skip leading whitespace */
-	wchar_t ch = line[index];
+	char ch = line[index];
 	while (1)
 	{
-		if (iswspace(ch))
+		size_t space_size = get_utf8_space_size(line+index);
+		if (space_size)
 		{
-			ch = line[++index];
+			index += space_size;
+			ch = line[index];
 		}
-		else if (ch == L'\0' || ch == L'#')
+		else if (ch == '\0' || ch == '#')
 		{ /* break on EOL or comment */
 			line = NULL;
 			return NULL;
@@ -509,7 +1015,7 @@ token_t * parse_one_token(wchar_t * line_start)
 	/* non-whitespace char found, try parsing */
 	static buffer_t string_buf = DEFAULT_BUFFER_T;
 	
-	if (ch == L'\"')
+	if (ch == '\"')
 	{ /* try parsing string */
 		token.type = TOK_STR;
 		
@@ -521,50 +1027,50 @@ token_t * parse_one_token(wchar_t * line_start)
 		while (!end_flag)
 		{
 			ch = line[++index];
-			if (ch == L'\0')
+			if (ch == '\0')
 			{
 				err("String with no end quote");
 				line = NULL;
 				return NULL;
 			}
-			else if (ch == L'\"')
+			else if (ch == '\"')
 			{ /* end */
-				ch = L'\0';
+				ch = '\0';
 				end_flag = 1;
 			}
-			else if (ch == L'\\')
+			else if (ch == '\\')
 			{ /* escape */
 				ch = line[++index];
-				if (ch == L'\0')
+				if (ch == '\0')
 				{
 					/* we don't have the next line so escaping newlines won't work */
 					err("Escaping newlines is not supported");
 					line = NULL;
 					return NULL;
 				}
-				else if (ch == L'n')
+				else if (ch == 'n')
 				{
-					ch = L'\n';
+					ch = '\n';
 				}
 			}
 			
-			append_buffer_wchar(&string_buf, ch);
+			append_buffer_char(&string_buf, ch);
 		}
 		token.value = string_buf.data;
 		index++; /* because we're still pointing at the end quote */
 	}
-	else if (ch == L'$' || iswdigit(ch))
+	else if (ch == '$' || isdigit((uint8_t)ch))
 	{ /* try parsing number */
 		token.type = TOK_NUM;
 		
 		int hex = 0;
 		intptr_t out = 0;
-		if (ch == L'$')
+		if (ch == '$')
 		{
 			hex = 1;
 			ch = line[index += 1];
 		}
-		else if (ch == L'0' && line[index+1] == L'x')
+		else if (ch == '0' && line[index+1] == 'x')
 		{
 			hex = 1;
 			ch = line[index += 2];
@@ -574,19 +1080,21 @@ token_t * parse_one_token(wchar_t * line_start)
 		while (1)
 		{
 			unsigned digit = 0;
-			if (iswspace(ch) || ch == L'\0' || ch == L'#')
+			if (get_utf8_space_size(line+index) || ch == '\0' || ch == '#')
 			{ /* stop parsing on EOL, whitespace, or comment */
 				break;
 			}
-			else if (ch >= L'0' && ch <= L'9')
-				digit = ch - L'0';
-			else if (hex && ch >= L'A' && ch <= L'F')
-				digit = ch - L'A' + 0x0a;
-			else if (hex && ch >= L'a' && ch <= L'f')
-				digit = ch - L'a' + 0x0a;
+			else if (ch >= '0' && ch <= '9')
+				digit = ch - '0';
+			else if (hex && ch >= 'A' && ch <= 'F')
+				digit = ch - 'A' + 0x0a;
+			else if (hex && ch >= 'a' && ch <= 'f')
+				digit = ch - 'a' + 0x0a;
 			else
 			{
-				werr(L"Can't parse %lc as digit",ch);
+				size_t char_size = get_utf8_char_size(line+index);
+				err("Can't parse %.*s as digit",(int)char_size,line+index);
+				index += char_size-1;
 				error++;
 			}
 			
@@ -622,13 +1130,13 @@ token_t * parse_one_token(wchar_t * line_start)
 		int end_flag = 0;
 		while (!end_flag)
 		{
-			if (iswspace(ch) || ch == L'\0' || ch == L'#')
+			if (get_utf8_space_size(line+index) || ch == '\0' || ch == '#')
 			{
-				ch = L'\0';
+				ch = '\0';
 				end_flag = 1;
 			}
 			
-			append_buffer_wchar(&string_buf, ch);
+			append_buffer_char(&string_buf, ch);
 			
 			if (!end_flag)
 				ch = line[++index];
@@ -642,7 +1150,7 @@ token_t * parse_one_token(wchar_t * line_start)
 }
 
 
-token_t * parse_one_token_type(wchar_t * line_start, int expected_type)
+token_t * parse_one_token_type(char * line_start, int expected_type)
 {
 	token_t * tok = parse_one_token(line_start);
 	if (!tok)
@@ -665,14 +1173,14 @@ token_t * parse_one_token_type(wchar_t * line_start, int expected_type)
 
 /****************************** Tags ****************************/
 
-gsf_tag_t * get_gsf_tag(wchar_t * name)
+gsf_tag_t * get_gsf_tag(char * name)
 {
 	for (size_t i = 0; i < gsf_tag_buf.size; i += sizeof(gsf_tag_t))
 	{
 		gsf_tag_t * cmp_tag = gsf_tag_buf.data + i;
 		if (!is_buffer_new(&cmp_tag->name_buf))
 		{
-			if (!wcscmp(name,cmp_tag->name_buf.data))
+			if (!strcmp(name,cmp_tag->name_buf.data))
 			{
 				return cmp_tag;
 			}
@@ -681,7 +1189,7 @@ gsf_tag_t * get_gsf_tag(wchar_t * name)
 	return NULL;
 }
 
-wchar_t * get_gsf_tag_value(wchar_t *name)
+char * get_gsf_tag_value(char *name)
 {
 	gsf_tag_t * found_tag = get_gsf_tag(name);
 	if (found_tag && !is_buffer_new(&found_tag->value_buf))
@@ -691,7 +1199,7 @@ wchar_t * get_gsf_tag_value(wchar_t *name)
 	return NULL;
 }
 
-void set_gsf_tag(wchar_t * name, wchar_t * value)
+void set_gsf_tag(char * name, char * value)
 {
 	/* check if this tag already exists in the list */
 	init_new_buffer(&gsf_tag_buf, 0x10*sizeof(gsf_tag_t));
@@ -699,8 +1207,8 @@ void set_gsf_tag(wchar_t * name, wchar_t * value)
 	gsf_tag_t * found_tag = get_gsf_tag(name);
 	
 	/* if the tag is not new, replace its value buffer */
-	size_t value_len = value ? wcslen(value) : 0;
-	size_t value_size = (value_len+1)*sizeof(wchar_t);
+	size_t value_len = value ? strlen(value) : 0;
+	size_t value_size = value_len+1;
 	if (found_tag)
 	{
 		buffer_t * value_buf = &found_tag->value_buf;
@@ -718,8 +1226,7 @@ void set_gsf_tag(wchar_t * name, wchar_t * value)
 	{
 		if (value_len)
 		{
-			size_t name_len = wcslen(name);
-			size_t name_size = (name_len+1)*sizeof(wchar_t);
+			size_t name_size = strlen(name)+1;
 			init_buffer(&new_tag.name_buf, name_size);
 			init_buffer(&new_tag.value_buf, value_size);
 			set_buffer(&new_tag.name_buf, name, name_size);
@@ -729,32 +1236,54 @@ void set_gsf_tag(wchar_t * name, wchar_t * value)
 	}
 }
 
-int gsf_tag_name_ok(wchar_t * name)
+int gsf_tag_name_ok(char * name)
 {
 	int error = 0;
-	size_t name_len = wcslen(name);
+	size_t name_len = strlen(name);
 	if (!name_len)
 	{
 		err("GSF tag name is blank");
 		error++;
 	}
 	int bad_tag_name = 0;
-	if (name[0] == L'_' || !wcscmp(name,L"filedir") || !wcscmp(name,L"filename") || !wcscmp(name,L"fileext"))
+	if (name[0] == '_' || !strcmp(name,"filedir") || !strcmp(name,"filename") || !strcmp(name,"fileext"))
 	{
-		werr(L"GSF tag name %ls is reserved", name);
+		err("GSF tag name %s is reserved", name);
 		error++;
 	}
-	for (size_t i = 0; i < name_len; i++)
+	/* the name is lowercased in place. a character whose lowercase form is
+		longer in UTF-8 is left alone */
+	size_t out = 0;
+	for (size_t i = 0; i < name_len; )
 	{
-		wchar_t ch = name[i];
-		if (!iswalnum(ch) && ch != L'_')
+		unsigned ch;
+		size_t length = decode_utf8(name+i, name_len-i, &ch);
+		if (!length)
+		{
+			bad_tag_name++;
+			name[out++] = name[i++];
+			continue;
+		}
+		if (!iswalnum(ch) && ch != '_')
 			bad_tag_name++;
-		if (!iswlower(ch))
-			name[i] = towlower(ch);
+		char lower[4];
+		size_t lower_length = encode_utf8(lower, towlower(ch));
+		if (lower_length <= length)
+		{
+			memcpy(name+out, lower, lower_length);
+			out += lower_length;
+		}
+		else
+		{
+			memmove(name+out, name+i, length);
+			out += length;
+		}
+		i += length;
 	}
+	name[out] = '\0';
 	if (bad_tag_name)
 	{
-		werr(L"Invalid GSF tag name %ls", name);
+		err("Invalid GSF tag name %s", name);
 		return 0;
 	}
 	if (error)
@@ -763,12 +1292,12 @@ int gsf_tag_name_ok(wchar_t * name)
 	return 1;
 }
 
-token_t * parse_set_gsf_tag(wchar_t * name)
+token_t * parse_set_gsf_tag(char * name)
 {
 	token_t * value_tok = parse_one_token_type(NULL,TOK_STR);
 	if (value_tok)
 	{
-		wchar_t * value = value_tok->value;
+		char * value = value_tok->value;
 		set_gsf_tag(name,value);
 	}
 	else
@@ -778,12 +1307,12 @@ token_t * parse_set_gsf_tag(wchar_t * name)
 	return value_tok;
 }
 
-token_t * parse_set_gsf_tag_optional(wchar_t * name)
+token_t * parse_set_gsf_tag_optional(char * name)
 {
 	token_t * value_tok = parse_one_token_type(NULL,TOK_STR);
 	if (value_tok)
 	{
-		wchar_t * value = value_tok->value;
+		char * value = value_tok->value;
 		set_gsf_tag(name,value);
 	}
 	return value_tok;
@@ -792,314 +1321,551 @@ token_t * parse_set_gsf_tag_optional(wchar_t * name)
 
 
 
-/********************** generic gsf-related ************************/
+/************************ Compression *****************************/
+
+/* programs are always compressed from a complete buffer, so a backend only
+	has to provide compress_program and get_program_crc32. zlib is the
+	default, libdeflate can be selected at compile time (see the Makefile) */
+
+/* large programs are compressed block by block, with the settings chosen
+	from a quick estimate. blocks with high byte entropy and almost no repeated
+	strings (usually PCM samples) can't gain anything from string matching, so
+	they are only huffman coded, or stored if even that wouldn't help.
+	everything else gets the best compression. it's all still one zlib
+	stream */
+#define COMPRESS_BLOCK_SIZE 0x10000
+#define HUFFMAN_BLOCK_ENTROPY 7.0
+#define STORED_BLOCK_ENTROPY 7.9
+#define HUFFMAN_BLOCK_MATCHES 0x40  /* per 0x1000 positions */
+
+typedef struct {
+	int level;
+	int strategy;
+} compress_params_t;
 
-char * get_os_filename(wchar_t * filename)
+/* order-0 entropy in bits per symbol, from a histogram */
+double get_entropy(unsigned * count, unsigned symbols, size_t total)
 {
-	/** remove any non-filename-valid characters **/
-	size_t filename_len = wcslen(filename);
-	size_t index = 0;
-	while (1)
+	double entropy = 0;
+	for (unsigned i = 0; i < symbols; i++)
 	{
-		wchar_t ch = filename[index];
-		if (ch == '\0')
-			break;
-		else if (ch < 0x20 || wcschr(L"<>:\"/\\|?*", ch))
-		{
-			memmove(filename+index, filename+index+1, (filename_len-index)*sizeof(wchar_t));
-			filename_len--;
-		}
-		else
+		if (count[i])
 		{
-			index++;
+			double p = (double)count[i] / total;
+			entropy -= p * log2(p);
 		}
 	}
-	
-	/** convert to os-preferred format **/
-	static buffer_t os_filename_buf = DEFAULT_BUFFER_T;
-	os_filename_buf.size = 0;
-	iconv_2(os_character_encoding,"wchar_t", &os_filename_buf, filename, (filename_len+1)*sizeof(wchar_t));
-	return os_filename_buf.data;
+	return entropy;
 }
 
-void write_gsf_data_to_file(FILE * f, uint8_t * data, size_t size)
+compress_params_t get_block_params(uint8_t * data, size_t size)
 {
-	/* compress the program data */
-	z_stream zs;
-	memset(&zs,0,sizeof(zs));
-	int status;
-	if ((status = deflateInit(&zs, Z_DEFAULT_COMPRESSION)) != Z_OK)
+	compress_params_t best = {Z_BEST_COMPRESSION, Z_DEFAULT_STRATEGY};
+	compress_params_t huffman = {Z_BEST_SPEED, Z_HUFFMAN_ONLY};
+	compress_params_t stored = {Z_NO_COMPRESSION, Z_DEFAULT_STRATEGY};
+	if (size < 4)
+		return best;
+	
+	unsigned count[0x100] = {0};
+	for (size_t i = 0; i < size; i++)
+		count[data[i]]++;
+	
+	double entropy = get_entropy(count, 0x100, size);
+	if (entropy < HUFFMAN_BLOCK_ENTROPY)
+		return best;
+	
+	/* high entropy can still hide repeated strings that deflate finds, so
+		count the 4-byte strings already seen in a small hash table */
+	uint32_t seen[0x1000];
+	memset(seen, 0, sizeof(seen));
+	size_t matches = 0;
+	for (size_t i = 0; i + 4 <= size; i++)
 	{
-		err("Error %d initializing zlib",status);
-		return;
+		uint32_t v;
+		memcpy(&v, data+i, 4);
+		uint32_t * slot = &seen[(v * 2654435761u) >> 20];
+		matches += *slot == v;
+		*slot = v;
 	}
+	if (matches * 0x1000 / size >= HUFFMAN_BLOCK_MATCHES)
+		return best;
 	
-	static buffer_t out_buf = DEFAULT_BUFFER_T;
-	init_new_buffer(&out_buf,0x10000);
-	out_buf.size = 0;
+	return entropy < STORED_BLOCK_ENTROPY ? huffman : stored;
+}
+
+void expand_deflate_output(z_stream * zs, buffer_t * out_buf)
+{
+	out_buf->size = zs->total_out;
+	expand_buffer(out_buf, out_buf->max*2);
+	zs->next_out = out_buf->data + out_buf->size;
+	zs->avail_out = out_buf->max - out_buf->size;
+}
+
+/* feeds a program to an initialized deflate stream, block by block, ending
+	with the given flush. returns the last zlib status */
+int deflate_program_blocks(z_stream * zs, uint8_t * data, size_t size, int final_flush, buffer_t * out_buf)
+{
+	init_new_buffer(out_buf,0x10000);
+	zs->next_out = out_buf->data + out_buf->size;
+	zs->avail_out = out_buf->max - out_buf->size;
 	
-	zs.next_in = data;
-	zs.avail_in = size;
-	zs.next_out = out_buf.data;
-	zs.avail_out = out_buf.max;
-	while (1)
+	int status = Z_OK;
+	compress_params_t params = {Z_DEFAULT_COMPRESSION, Z_DEFAULT_STRATEGY};
+	size_t offset = 0;
+	do
 	{
-		status = deflate(&zs, zs.avail_in ? Z_NO_FLUSH : Z_FINISH);
-		out_buf.size = zs.total_out;
-		if (status == Z_STREAM_END)
+		size_t block_size = size - offset;
+		if (size >= 2*COMPRESS_BLOCK_SIZE)
 		{
-			break;
+			if (block_size > COMPRESS_BLOCK_SIZE)
+				block_size = COMPRESS_BLOCK_SIZE;
+			compress_params_t block_params = get_block_params(data+offset, block_size);
+			if (block_params.level != params.level || block_params.strategy != params.strategy)
+			{
+				/* this flushes the previous block, which may need more space */
+				while ((status = deflateParams(zs, block_params.level, block_params.strategy)) == Z_BUF_ERROR)
+					expand_deflate_output(zs, out_buf);
+				if (status != Z_OK)
+					break;
+				params = block_params;
+			}
 		}
-		else if (status != Z_OK)
+		
+		zs->next_in = data + offset;
+		zs->avail_in = block_size;
+		offset += block_size;
+		int flush = offset == size ? final_flush : Z_NO_FLUSH;
+		while (1)
 		{
-			err("Error %d during zlib compression",status);
-			deflateEnd(&zs);
-			free_buffer(&out_buf);
-			return;
+			status = deflate(zs, flush);
+			if (status == Z_BUF_ERROR)
+				status = Z_OK;
+			if (status != Z_OK)
+				break;
+			else if (zs->avail_out == 0)
+				expand_deflate_output(zs, out_buf);
+			else if (!zs->avail_in)
+				break;  /* a flush is complete once there is output space left */
 		}
-		else if (zs.avail_out == 0)
+	} while (status == Z_OK && offset < size);
+	out_buf->size = zs->total_out;
+	
+	return status;
+}
+
+/* inflates a zlib-compressed program. returns nonzero on success */
+int inflate_program(uint8_t * data, size_t size, size_t max_size, buffer_t * out_buf)
+{
+	z_stream zs;
+	memset(&zs,0,sizeof(zs));
+	if (inflateInit(&zs) != Z_OK)
+		return 0;
+	
+	init_new_buffer(out_buf, 0x1000);
+	out_buf->size = 0;
+	zs.next_in = data;
+	zs.avail_in = size;
+	int status;
+	do
+	{
+		if (out_buf->size == out_buf->max)
 		{
-			expand_buffer(&out_buf, out_buf.max*2);
-			zs.next_out = out_buf.data + out_buf.size;
-			zs.avail_out = out_buf.max - out_buf.size;
+			if (out_buf->max >= max_size)
+				break;
+			expand_buffer(out_buf, out_buf->max*2);
 		}
+		zs.next_out = out_buf->data + out_buf->size;
+		zs.avail_out = out_buf->max - out_buf->size;
+		status = inflate(&zs, Z_NO_FLUSH);
+		out_buf->size = zs.total_out;
+	} while (status == Z_OK);
+	inflateEnd(&zs);
+	
+	return status == Z_STREAM_END;
+}
+
+#ifdef USE_LIBDEFLATE
+
+#define LIBDEFLATE_LEVEL 9
+
+/* returns nonzero on success */
+int compress_program(uint8_t * data, size_t size, buffer_t * out_buf)
+{
+	/* made for each program, so it's covered by the job's COMPRESSOR_MEMORY */
+	struct libdeflate_compressor * compressor = libdeflate_alloc_compressor(LIBDEFLATE_LEVEL);
+	if (!compressor)
+	{
+		err("Can't allocate libdeflate compressor");
+		return 0;
 	}
 	
-	deflateEnd(&zs);
+	size_t bound = libdeflate_zlib_compress_bound(compressor, size);
+	init_new_buffer(out_buf, bound);
+	expand_buffer(out_buf, bound);
+	out_buf->size = libdeflate_zlib_compress(compressor, data, size, out_buf->data, out_buf->max);
+	libdeflate_free_compressor(compressor);
+	if (!out_buf->size)
+	{
+		err("Error during libdeflate compression");
+		free_buffer(out_buf);
+		return 0;
+	}
+	return 1;
+}
+
+uint32_t get_program_crc32(uint8_t * data, size_t size)
+{
+	return libdeflate_crc32(0, data, size);
+}
+
+#else
+
+/* returns nonzero on success */
+int compress_program(uint8_t * data, size_t size, buffer_t * out_buf)
+{
+	z_stream zs;
+	memset(&zs,0,sizeof(zs));
+	int status;
+	if ((status = deflateInit(&zs, Z_DEFAULT_COMPRESSION)) != Z_OK)
+	{
+		err("Error %d initializing zlib",status);
+		return 0;
+	}
 	
-	/* calculate compressed crc */
+	if (out_buf->data)
+		out_buf->size = 0;
+	status = deflate_program_blocks(&zs, data, size, Z_FINISH, out_buf);
+	deflateEnd(&zs);
+	if (status != Z_STREAM_END)
+	{
+		err("Error %d during zlib compression",status);
+		free_buffer(out_buf);
+		return 0;
+	}
+	return 1;
+}
+
+uint32_t get_program_crc32(uint8_t * data, size_t size)
+{
 	uLong crc = crc32(0L, Z_NULL, 0);
-	crc = crc32(crc,out_buf.data,out_buf.size);
-	
-	/* write the program data */
-	fputc('P',f);
-	fputc('S',f);
-	fputc('F',f);
-	fputc(0x22,f);
-	fput32(0,f);
-	fput32(out_buf.size,f);
-	fput32(crc,f);
-	fwrite(out_buf.data,1,out_buf.size,f);
-	
-	free_buffer(&out_buf);
+	return crc32(crc,data,size);
 }
 
-void write_gsf_tags_to_file(FILE *f)
+#endif
+
+/* what compressing a program is expected to take besides the program: the
+	output, which can grow to twice the program, and the compressor */
+#ifdef USE_LIBDEFLATE
+#define COMPRESSOR_MEMORY 0x100000
+#else
+#define COMPRESSOR_MEMORY 0x48000
+#endif
+
+size_t get_compress_memory(size_t size)
 {
-	fwrite("[TAG]",1,5,f);
-	for (size_t i = 0; i < gsf_tag_buf.size; i += sizeof(gsf_tag_t))
+	return size*2 + COMPRESSOR_MEMORY;
+}
+
+/* the same for inflating a compressed program of the given size, whose
+	real size isn't known until it's done */
+#define GUESSED_DEFLATE_RATIO 4
+
+size_t get_inflate_memory(size_t size)
+{
+	return size*GUESSED_DEFLATE_RATIO*2 + 0x10000;
+}
+
+/* the slowest, smallest compression, for --recompress. with zlib, both the
+	default and the filtered strategy are tried. returns nonzero on
+	success */
+int compress_program_best(uint8_t * data, size_t size, int level, buffer_t * out_buf)
+{
+#ifdef USE_LIBDEFLATE
+	struct libdeflate_compressor * compressor = libdeflate_alloc_compressor(level);
+	if (!compressor)
 	{
-		gsf_tag_t * cmp_tag = gsf_tag_buf.data + i;
-		if (!is_buffer_new(&cmp_tag->name_buf) && !is_buffer_new(&cmp_tag->value_buf))
+		err("Can't allocate libdeflate compressor");
+		return 0;
+	}
+	
+	size_t bound = libdeflate_zlib_compress_bound(compressor, size);
+	init_new_buffer(out_buf, bound);
+	expand_buffer(out_buf, bound);
+	out_buf->size = libdeflate_zlib_compress(compressor, data, size, out_buf->data, out_buf->max);
+	libdeflate_free_compressor(compressor);
+	if (!out_buf->size)
+	{
+		err("Error during libdeflate compression");
+		free_buffer(out_buf);
+		return 0;
+	}
+	return 1;
+#else
+	static const int strategies[2] = {Z_DEFAULT_STRATEGY, Z_FILTERED};
+	buffer_t try_buf = DEFAULT_BUFFER_T;
+	out_buf->size = 0;
+	for (int i = 0; i < 2; i++)
+	{
+		z_stream zs;
+		memset(&zs,0,sizeof(zs));
+		int status;
+		if ((status = deflateInit2(&zs, level, Z_DEFLATED, 15, 9, strategies[i])) != Z_OK)
 		{
-			wchar_t * name = cmp_tag->name_buf.data;
-			size_t name_size = cmp_tag->name_buf.size - sizeof(wchar_t);
-			wchar_t * value = cmp_tag->value_buf.data;
-			size_t value_size = cmp_tag->value_buf.size - sizeof(wchar_t);
-			if (name && value)
-			{
-				static buffer_t out_name_buf = DEFAULT_BUFFER_T;
-				static buffer_t out_value_buf = DEFAULT_BUFFER_T;
-				out_name_buf.size = 0;
-				out_value_buf.size = 0;
-				iconv_2("UTF-8","wchar_t", &out_name_buf, name,name_size);
-				iconv_2("UTF-8","wchar_t", &out_value_buf, value,value_size);
-				
-				fwrite(out_name_buf.data,1,out_name_buf.size,f);
-				fputc('=',f);
-				for (size_t i = 0; i < out_value_buf.size; i++)
-				{
-					char ch = ((char*)out_value_buf.data)[i];
-					if (ch == '\n')
-					{ /* separate lines of a value must have the name= on each line */
-						fputc('\n',f);
-						fwrite(out_name_buf.data,1,out_name_buf.size,f);
-						fputc('=',f);
-					}
-					else
-					{
-						fputc(ch,f);
-					}
-				}
-				fputc('\n',f);
-			}
+			err("Error %d initializing zlib",status);
+			free_buffer(&try_buf);
+			return 0;
+		}
+		size_t bound = deflateBound(&zs, size);
+		init_new_buffer(&try_buf, bound);
+		expand_buffer(&try_buf, bound);
+		zs.next_in = data;
+		zs.avail_in = size;
+		zs.next_out = try_buf.data;
+		zs.avail_out = try_buf.max;
+		status = deflate(&zs, Z_FINISH);
+		try_buf.size = zs.total_out;
+		deflateEnd(&zs);
+		if (status != Z_STREAM_END)
+		{
+			err("Error %d during zlib compression",status);
+			free_buffer(&try_buf);
+			return 0;
 		}
+		if (!i || try_buf.size < out_buf->size)
+			set_buffer(out_buf, try_buf.data, try_buf.size);
 	}
-	fwrite("utf8=1",1,6,f);
+	free_buffer(&try_buf);
+	return 1;
+#endif
 }
 
+#ifdef USE_LIBDEFLATE
+#define BEST_COMPRESSION_LEVEL 12
+#else
+#define BEST_COMPRESSION_LEVEL Z_BEST_COMPRESSION
+#endif
 
+/* what compress_program_best is expected to take besides the program.
+	libdeflate's compressors above level 9 take about 9 MiB, and zlib keeps
+	a copy of the better of its two tries */
+#define BEST_COMPRESSOR_MEMORY 0x900000
+
+size_t get_compress_best_memory(size_t size, int level)
+{
+#ifdef USE_LIBDEFLATE
+	return size*2 + (level > LIBDEFLATE_LEVEL ? BEST_COMPRESSOR_MEMORY : COMPRESSOR_MEMORY);
+#else
+	(void)level;
+	return size*3 + COMPRESSOR_MEMORY;
+#endif
+}
 
 
 
 
 
-/************************ gsflib-related ***************************/
 
-void make_gsflib(wchar_t * inname, wchar_t * outname)
+
+/************************ Chunk cache *****************************/
+
+/* for quick rebuilds while a ROM hack is being worked on, a gsflib can be
+	compressed as independent chunks: each chunk is its own raw deflate
+	stream ended with a full flush, so the compressed chunks can just be
+	concatenated between a zlib header and trailer. compressed chunks are
+	kept in a cache file keyed by a hash of their data, and only the chunks
+	that changed are compressed again. chunks are always made with zlib,
+	whatever the backend */
+#define CACHE_CHUNK_SIZE 0x40000
+#define CACHE_MAGIC "MGSFCCH1"
+
+typedef struct {
+	uint64_t key;
+	uint32_t raw_size;
+	buffer_t data;
+} cache_chunk_t;
+
+uint64_t get_chunk_key(uint8_t * data, size_t size, uLong * adler)
 {
-	if (get_gsf_tag(L"_lib"))
-	{
-		err("gsflib filename already defined");
+	*adler = adler32(adler32(0L, Z_NULL, 0), data, size);
+	uLong crc = crc32(crc32(0L, Z_NULL, 0), data, size);
+	return ((uint64_t)crc << 32) | *adler;
+}
+
+/* a missing or broken cache is just empty */
+void load_chunk_cache(char * cache_filename, buffer_t * chunk_buf)
+{
+	FILE * f = fopen(cache_filename,"rb");
+	if (!f)
 		return;
+	
+	char magic[8];
+	if (fread(magic,1,8,f) == 8 && !memcmp(magic,CACHE_MAGIC,8))
+	{
+		while (1)
+		{
+			uint8_t header[0x10];
+			if (fread(header,1,0x10,f) != 0x10)
+				break;
+			cache_chunk_t chunk;
+			chunk.key = read32(header) | ((uint64_t)read32(header+4) << 32);
+			chunk.raw_size = read32(header+8);
+			size_t size = read32(header+0xc);
+			if (chunk.raw_size > CACHE_CHUNK_SIZE || size > 2*CACHE_CHUNK_SIZE)
+				break;
+			chunk.data = (buffer_t)DEFAULT_BUFFER_T;
+			init_buffer(&chunk.data, size ? size : 1);
+			chunk.data.size = fread(chunk.data.data,1,size,f);
+			if (chunk.data.size != size)
+			{
+				free_buffer(&chunk.data);
+				break;
+			}
+			init_new_buffer(chunk_buf, 0x80*sizeof(cache_chunk_t));
+			append_buffer(chunk_buf, &chunk, sizeof(chunk));
+		}
 	}
+	fclose(f);
+}
+
+/* the cache is replaced as a whole, so a cache that's being written is never
+	read half-done */
+void save_chunk_cache(char * cache_filename, buffer_t * chunk_buf)
+{
+	char * temp_filename = malloc(strlen(cache_filename)+sizeof(".tmp"));
+	strcpy(temp_filename, cache_filename);
+	strcat(temp_filename, ".tmp");
 	
-	char * os_filename = get_os_filename(inname);
-	FILE *f = fopen(os_filename,"rb");
+	FILE * f = fopen(temp_filename,"wb");
 	if (!f)
 	{
-		werr(L"Can't open %ls for reading (%s). Output .minigsfs may not work.",inname,strerror(errno));
+		warn("Can't write chunk cache %s (%s)",cache_filename,strerror(errno));
+		free(temp_filename);
 		return;
 	}
-	static buffer_t in_buf = DEFAULT_BUFFER_T;
-	init_new_buffer(&in_buf,0x10000);
-	write32(in_buf.data+0, entry_point);
-	write32(in_buf.data+4, entry_point);
-	in_buf.size = 0xc;
-	while (1)
+	fwrite(CACHE_MAGIC,1,8,f);
+	for (size_t i = 0; i < chunk_buf->size; i += sizeof(cache_chunk_t))
 	{
-		int ch = fgetc(f);
-		if (ch == EOF) break;
-		append_buffer_char(&in_buf,ch);
+		cache_chunk_t * chunk = chunk_buf->data + i;
+		uint8_t header[0x10];
+		write32(header, chunk->key);
+		write32(header+4, chunk->key >> 32);
+		write32(header+8, chunk->raw_size);
+		write32(header+0xc, chunk->data.size);
+		fwrite(header,1,0x10,f);
+		fwrite(chunk->data.data,1,chunk->data.size,f);
 	}
-	write32(in_buf.data+8, in_buf.size-0xc);
-	if (ferror(f))
+	int ok = !ferror(f);
+	ok &= fclose(f) == 0;
+	if (ok)
 	{
-		werr(L"Error while reading %ls (%s). Output .minigsfs may not work.",inname,strerror(errno));
+		remove(cache_filename);
+		ok = !rename(temp_filename, cache_filename);
 	}
-	fclose(f);
-	
-	os_filename = get_os_filename(outname);
-	f = fopen(os_filename,"wb");
-	if (!f)
+	if (!ok)
 	{
-		werr(L"Can't open %ls for writing (%s). Output .minigsfs may not work.",outname,strerror(errno));
-		free_buffer(&in_buf);
-		return;
+		warn("Can't write chunk cache %s (%s)",cache_filename,strerror(errno));
+		remove(temp_filename);
 	}
-	
-	write_gsf_data_to_file(f, in_buf.data, in_buf.size);
-	
-	fclose(f);
-	free_buffer(&in_buf);
+	free(temp_filename);
 }
 
+void free_chunk_cache(buffer_t * chunk_buf)
+{
+	for (size_t i = 0; i < chunk_buf->size; i += sizeof(cache_chunk_t))
+	{
+		cache_chunk_t * chunk = chunk_buf->data + i;
+		free_buffer(&chunk->data);
+	}
+	free_buffer(chunk_buf);
+}
 
-
-
-
-/************************ minigsf-related **************************/
-
-void make_minigsf()
+/* returns nonzero on success */
+int compress_chunk(uint8_t * data, size_t size, buffer_t * out_buf)
 {
-	if (!get_gsf_tag(L"_lib"))
+	z_stream zs;
+	memset(&zs,0,sizeof(zs));
+	int status;
+	if ((status = deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY)) != Z_OK)
 	{
-		err("gsflib filename not defined yet");
-		return;
+		err("Error %d initializing zlib",status);
+		return 0;
 	}
-	if (is_buffer_new(&filename_template_buf))
+	
+	status = deflate_program_blocks(&zs, data, size, Z_FULL_FLUSH, out_buf);
+	deflateEnd(&zs);
+	if (status != Z_OK)
 	{
-		err("Filename template not defined yet");
-		return;
+		err("Error %d during zlib compression",status);
+		return 0;
 	}
+	return 1;
+}
+
+/* returns nonzero on success */
+int compress_program_cached(uint8_t * data, size_t size, char * cache_filename, buffer_t * out_buf)
+{
+	buffer_t old_chunk_buf = DEFAULT_BUFFER_T;
+	buffer_t new_chunk_buf = DEFAULT_BUFFER_T;
+	load_chunk_cache(cache_filename, &old_chunk_buf);
+	init_buffer(&new_chunk_buf, 0x80*sizeof(cache_chunk_t));
 	
+	init_new_buffer(out_buf, size/2 + 0x100);
+	out_buf->size = 0;
+	static const uint8_t zlib_header[2] = {0x78, 0xda};
+	append_buffer(out_buf, zlib_header, 2);
 	
-	/** transform filename template to real filename **/
-	wchar_t * filename_template = filename_template_buf.data;
-	static buffer_t filename_buf = DEFAULT_BUFFER_T;
-	init_new_buffer(&filename_buf, 0x200);
-	filename_buf.size = 0;
-	size_t index = 0;
-	while (1)
+	uLong adler = adler32(0L, Z_NULL, 0);
+	size_t reused = 0;
+	int ok = 1;
+	for (size_t offset = 0; ok && offset < size; offset += CACHE_CHUNK_SIZE)
 	{
-		wchar_t ch = filename_template[index++];
-		if (ch == L'\0')
-			break;
-		else if (ch == L'%')
-		{ /* conversion code */
-			unsigned number = 0;
-			while (1)
+		size_t chunk_size = size - offset < CACHE_CHUNK_SIZE ? size - offset : CACHE_CHUNK_SIZE;
+		cache_chunk_t chunk;
+		uLong chunk_adler;
+		chunk.key = get_chunk_key(data+offset, chunk_size, &chunk_adler);
+		chunk.raw_size = chunk_size;
+		chunk.data = (buffer_t)DEFAULT_BUFFER_T;
+		adler = adler32_combine(adler, chunk_adler, chunk_size);
+		
+		for (size_t i = 0; i < old_chunk_buf.size; i += sizeof(cache_chunk_t))
+		{
+			cache_chunk_t * old_chunk = old_chunk_buf.data + i;
+			if (old_chunk->key == chunk.key && old_chunk->raw_size == chunk.raw_size && !is_buffer_new(&old_chunk->data))
 			{
-				ch = filename_template[index++];
-				if (ch == L'\0')
-				{
-					err("Incomplete conversion specifier in filename template");
-					return;
-				}
-				else if (iswdigit(ch))
-				{
-					unsigned digit = ch - L'0';
-					number *= 10;
-					number += digit;
-				}
-				else if (ch == L'n')
-				{ /* song number */
-					wchar_t out_buf[0x10];
-					size_t written = swprintf(out_buf,0x10, L"%0*u", number,song_number);
-					append_buffer(&filename_buf,out_buf,written*sizeof(wchar_t));
-					break;
-				}
-				else if (ch == L'i')
-				{ /* song id */
-					wchar_t out_buf[0x10];
-					size_t written = swprintf(out_buf,0x10, L"%0*u", number,song_id);
-					append_buffer(&filename_buf,out_buf,written*sizeof(wchar_t));
-					break;
-				}
-				else if (ch == L't')
-				{ /* title */
-					gsf_tag_t * tag = get_gsf_tag(L"title");
-					if (tag && !is_buffer_new(&tag->value_buf))
-						append_buffer(&filename_buf,tag->value_buf.data,tag->value_buf.size-sizeof(wchar_t));
-					else
-						warn("Title conversion specifier requested, but is not defined");
-					break;
-				}
-				else if (ch == L'a')
-				{ /* artist */
-					gsf_tag_t * tag = get_gsf_tag(L"artist");
-					if (tag && !is_buffer_new(&tag->value_buf))
-						append_buffer(&filename_buf,tag->value_buf.data,tag->value_buf.size-sizeof(wchar_t));
-					else
-						warn("Artist conversion specifier requested, but is not defined");
-					break;
-				}
-				else
-				{
-					err("Invalid conversion specifier '%lc' in filename template",ch);
-					return;
-				}
+				chunk.data = old_chunk->data;
+				old_chunk->data = (buffer_t)DEFAULT_BUFFER_T;
+				reused++;
+				break;
 			}
 		}
-		else
+		if (is_buffer_new(&chunk.data))
+			ok = compress_chunk(data+offset, chunk_size, &chunk.data);
+		
+		if (ok)
 		{
-			append_buffer_wchar(&filename_buf,ch);
+			append_buffer(out_buf, chunk.data.data, chunk.data.size);
+			append_buffer(&new_chunk_buf, &chunk, sizeof(chunk));
 		}
 	}
-	append_buffer_wchar(&filename_buf,'\0');
+	free_chunk_cache(&old_chunk_buf);
 	
-	
-	
-	/** save minigsf data **/
-	char * os_filename = get_os_filename(filename_buf.data);
-	FILE *f = fopen(os_filename,"wb");
-	if (!f)
+	if (ok)
 	{
-		wprintf(L"Can't open %ls for writing (%s)", filename_buf.data, strerror(errno));
-		return;
+		/* empty final block, then the adler-32 of everything, big-endian */
+		uint8_t trailer[6] = {0x03, 0x00, adler >> 24, adler >> 16, adler >> 8, adler};
+		append_buffer(out_buf, trailer, 6);
+		
+		save_chunk_cache(cache_filename, &new_chunk_buf);
+		size_t chunks = new_chunk_buf.size / sizeof(cache_chunk_t);
+		warn("Reused %zu of %zu compressed chunks", reused, chunks);
 	}
-	uint8_t program_data[0x10];
-	write32(program_data+0, entry_point);
-	write32(program_data+4, minigsf_offset);
-	write32(program_data+8, 4);
-	write32(program_data+0xc, song_id);
-	
-	write_gsf_data_to_file(f, program_data, 0x10);
-	write_gsf_tags_to_file(f);
-	
-	fclose(f);
+	else
+	{
+		free_buffer(out_buf);
+	}
+	free_chunk_cache(&new_chunk_buf);
 	
-	song_number++;
+	return ok;
 }
 
 
@@ -1108,223 +1874,4392 @@ void make_minigsf()
 
 
 
+/********************** generic gsf-related ************************/
 
-/*************************** Main *****************************/
+/* returns nonzero if the character can't be in a filename */
+int is_bad_filename_char(char ch)
+{
+	return (uint8_t)ch < 0x20 || strchr("<>:\"/\\|?*", ch);
+}
 
-int main(int argc, char *argv[])
+/* appends the characters of a string that can be in a filename. with
+	keep_slashes, '/' is kept to separate directories */
+void append_sanitized(buffer_t * buf, const char * s, size_t size, int keep_slashes)
 {
-	setlocale(LC_ALL,"");
-	
-	if (argc != 2)
+	expand_buffer(buf, buf->size+size);
+	char * out = buf->data + buf->size;
+	for (size_t i = 0; i < size; i++)
 	{
-		puts("usage: makegsf scriptfile");
-		return EXIT_FAILURE;
+		if (!is_bad_filename_char(s[i]) || (keep_slashes && s[i] == '/'))
+			*out++ = s[i];
 	}
-#ifdef _WIN32
-	sprintf(os_character_encoding, "CP%u", GetACP());
-#endif
-	
-	
-	open_script(argv[1]);
+	buf->size = out - (char *)buf->data;
+}
+
+/* converts an already sanitized path to the os-preferred format, if it
+	isn't UTF-8. returns NULL if the path can't be represented in it */
+char * get_os_path(char * path)
+{
+	if (os_encoding_is_utf8)
+		return path;
+	static buffer_t os_path_buf = DEFAULT_BUFFER_T;
+	os_path_buf.size = 0;
+	if (!iconv_2(os_character_encoding,"UTF-8", &os_path_buf, path, strlen(path)+1))
+		return NULL;
+	return os_path_buf.data;
+}
+
+char * get_os_filename(char * filename)
+{
+	/** remove any non-filename-valid characters. these are all ASCII, so
+		UTF-8 can be checked byte by byte **/
+	size_t filename_len = 0;
+	for (char * p = filename; *p; p++)
+	{
+		if (!is_bad_filename_char(*p))
+			filename[filename_len++] = *p;
+	}
+	filename[filename_len] = '\0';
 	
-	while (1)
+	return get_os_path(filename);
+}
+
+/* returns a newly allocated path of a file named in the script, relative to
+	the script. a name made from the filename template is already sanitized.
+	reports an error and returns NULL if the name can't be converted */
+char * make_script_path(char * name, int is_sanitized)
+{
+	char * os_name = is_sanitized ? get_os_path(name) : get_os_filename(name);
+	if (!os_name)
 	{
-		wchar_t * line = read_script_line();
+		err("Can't convert the filename %s to the system's encoding",name);
+		return NULL;
+	}
+	return get_script_path(os_name);
+}
+
+/* output files are created relative to a cached descriptor of their
+	directory, so a big set spread over directories by the filename
+	template doesn't look up the whole path for every file. directories
+	are made when the first file is created in them */
+#define MAX_CACHED_DIRS 0x100
+
+typedef struct {
+	char * path;
+	int fd;
+} cached_dir_t;
+
+pthread_mutex_t dir_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+cached_dir_t cached_dirs[MAX_CACHED_DIRS];
+size_t cached_dir_count = 0;
+
+int make_dir(char * path)
+{
+#ifdef _WIN32
+	return mkdir(path);
+#else
+	return mkdir(path, 0777);
+#endif
+}
+
+/* makes a directory and any of its parents that don't exist yet */
+void make_dirs(char * path)
+{
+	for (char * p = path + 1; *p; p++)
+	{
+		if (*p != '/' && *p != '\\')
+			continue;
+		char ch = *p;
+		*p = '\0';
+		make_dir(path);
+		*p = ch;
+	}
+	make_dir(path);
+}
+
+#ifdef _WIN32
+FILE * create_output_file(char * path)
+{
+	/* there's no openat, so only the directories are made on demand */
+	FILE * f = fopen(path,"wb");
+	if (f || errno != ENOENT)
+		return f;
+	char * slash = strrchr(path, '/');
+	char * backslash = strrchr(path, '\\');
+	if (backslash > slash)
+		slash = backslash;
+	if (!slash || slash == path)
+		return NULL;
+	char ch = *slash;
+	*slash = '\0';
+	make_dirs(path);
+	*slash = ch;
+	return fopen(path,"wb");
+}
+#else
+FILE * create_output_file(char * path)
+{
+	char * slash = strrchr(path, '/');
+	char * name = slash ? slash + 1 : path;
+	char * dir_path = slash ? strndup(path, slash == path ? 1 : (size_t)(slash - path)) : strdup(".");
+	
+	pthread_mutex_lock(&dir_cache_mutex);
+	int dir_fd = -1;
+	int is_cached = 0;
+	for (size_t i = 0; i < cached_dir_count; i++)
+	{
+		if (!strcmp(cached_dirs[i].path, dir_path))
+		{
+			dir_fd = cached_dirs[i].fd;
+			is_cached = 1;
+			break;
+		}
+	}
+	if (dir_fd < 0)
+	{
+		dir_fd = open(dir_path, O_RDONLY | O_DIRECTORY);
+		if (dir_fd < 0 && errno == ENOENT)
+		{
+			make_dirs(dir_path);
+			dir_fd = open(dir_path, O_RDONLY | O_DIRECTORY);
+		}
+		if (dir_fd >= 0 && cached_dir_count < MAX_CACHED_DIRS)
+		{
+			cached_dirs[cached_dir_count].path = dir_path;
+			cached_dirs[cached_dir_count].fd = dir_fd;
+			cached_dir_count++;
+			is_cached = 1;
+			dir_path = NULL;
+		}
+	}
+	pthread_mutex_unlock(&dir_cache_mutex);
+	free(dir_path);
+	if (dir_fd < 0)
+		return NULL;
+	
+	int fd = openat(dir_fd, name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	int error = errno;
+	if (!is_cached)
+		close(dir_fd);
+	errno = error;
+	FILE * f = fd >= 0 ? fdopen(fd, "wb") : NULL;
+	if (fd >= 0 && !f)
+		close(fd);
+	return f;
+}
+#endif
+
+void close_cached_dirs()
+{
+	for (size_t i = 0; i < cached_dir_count; i++)
+	{
+#ifndef _WIN32
+		close(cached_dirs[i].fd);
+#endif
+		free(cached_dirs[i].path);
+	}
+	cached_dir_count = 0;
+}
+
+/* returns nonzero on success */
+int write_gsf_compressed_data_to_file(FILE * f, uint8_t * data, size_t size)
+{
+	/* calculate compressed crc */
+	uint32_t crc = get_program_crc32(data, size);
+	
+	/* write the program data */
+	fputc('P',f);
+	fputc('S',f);
+	fputc('F',f);
+	fputc(0x22,f);
+	fput32(0,f);
+	fput32(size,f);
+	fput32(crc,f);
+	fwrite(data,1,size,f);
+	
+	return !ferror(f);
+}
+
+/* returns nonzero on success */
+int write_gsf_data_to_file(FILE * f, uint8_t * data, size_t size)
+{
+	/* not static, this can run on several threads at once */
+	buffer_t out_buf = DEFAULT_BUFFER_T;
+	if (!compress_program(data, size, &out_buf))
+		return 0;
+	
+	int ok = write_gsf_compressed_data_to_file(f, out_buf.data, out_buf.size);
+	
+	free_buffer(&out_buf);
+	return ok;
+}
+
+/* reads the header of an existing gsf file and checks the CRC of its
+	program. returns nonzero if the file is valid, and the offset of its tag
+	section */
+int check_gsf_file(FILE * f, size_t * tag_offset)
+{
+	uint8_t header[0x10];
+	if (fread(header,1,0x10,f) != 0x10 || memcmp(header,"PSF\x22",4))
+		return 0;
+	uint32_t reserved_size = read32(header+4);
+	uint32_t program_size = read32(header+8);
+	if (fseek(f, reserved_size, SEEK_CUR))
+		return 0;
+	
+	uLong crc = crc32(0L, Z_NULL, 0);
+	uint8_t data[0x4000];
+	for (uint32_t left = program_size; left; )
+	{
+		size_t size = left < sizeof(data) ? left : sizeof(data);
+		if (fread(data,1,size,f) != size)
+			return 0;
+		crc = crc32(crc, data, size);
+		left -= size;
+	}
+	if (crc != read32(header+0xc))
+		return 0;
+	
+	*tag_offset = 0x10 + (size_t)reserved_size + program_size;
+	return 1;
+}
+
+/* returns nonzero if an existing gsf file is valid */
+int is_gsf_file_valid(char * filename)
+{
+	FILE * f = fopen(filename,"rb");
+	if (!f)
+		return 0;
+	size_t tag_offset;
+	int valid = check_gsf_file(f, &tag_offset);
+	fclose(f);
+	return valid;
+}
+
+/* replaces the tag section of an existing gsf file, without touching the
+	rest of it. the file isn't written at all if the tags are the same.
+	returns 1 on success, 0 if the file is missing or not valid, and -1 if
+	it couldn't be written */
+int retag_gsf_file(char * filename, buffer_t * tag_buf)
+{
+	FILE * f = fopen(filename,"r+b");
+	if (!f)
+		return 0;
+	size_t tag_offset;
+	if (!check_gsf_file(f, &tag_offset))
+	{
+		fclose(f);
+		return 0;
+	}
+	
+	int same = 0;
+	if (!fseek(f, 0, SEEK_END) && (size_t)ftell(f) == tag_offset + tag_buf->size)
+	{
+		uint8_t * old_tags = malloc(tag_buf->size ? tag_buf->size : 1);
+		same = !fseek(f, tag_offset, SEEK_SET) && fread(old_tags,1,tag_buf->size,f) == tag_buf->size
+			&& !memcmp(old_tags, tag_buf->data, tag_buf->size);
+		free(old_tags);
+	}
+	
+	int ok = 1;
+	if (!same)
+	{
+		ok = !fseek(f, tag_offset, SEEK_SET);
+		if (ok)
+			fwrite(tag_buf->data,1,tag_buf->size,f);
+		ok &= fflush(f) == 0;
+		ok &= !ferror(f);
+		ok &= !ftruncate(fileno(f), tag_offset + tag_buf->size);
+	}
+	ok &= fclose(f) == 0;
+	return ok ? 1 : -1;
+}
+
+/* converts the current tags to the raw [TAG] section, so that it can be
+	written later by a job */
+void make_gsf_tag_data(buffer_t * out_buf)
+{
+	init_new_buffer(out_buf, 0x200);
+	out_buf->size = 0;
+	
+	append_buffer(out_buf,"[TAG]",5);
+	for (size_t i = 0; i < gsf_tag_buf.size; i += sizeof(gsf_tag_t))
+	{
+		gsf_tag_t * cmp_tag = gsf_tag_buf.data + i;
+		if (!is_buffer_new(&cmp_tag->name_buf) && !is_buffer_new(&cmp_tag->value_buf))
+		{
+			char * name = cmp_tag->name_buf.data;
+			size_t name_size = cmp_tag->name_buf.size - 1;
+			char * value = cmp_tag->value_buf.data;
+			size_t value_size = cmp_tag->value_buf.size - 1;
+			if (name && value)
+			{
+				/* tags are kept as UTF-8 already */
+				append_buffer(out_buf,name,name_size);
+				append_buffer_char(out_buf,'=');
+				for (size_t j = 0; j < value_size; j++)
+				{
+					char ch = value[j];
+					if (ch == '\n')
+					{ /* separate lines of a value must have the name= on each line */
+						append_buffer_char(out_buf,'\n');
+						append_buffer(out_buf,name,name_size);
+						append_buffer_char(out_buf,'=');
+					}
+					else
+					{
+						append_buffer_char(out_buf,ch);
+					}
+				}
+				append_buffer_char(out_buf,'\n');
+			}
+		}
+	}
+	append_buffer(out_buf,"utf8=1",6);
+}
+
+
+
+
+
+
+
+/************************ gsflib-related ***************************/
+
+typedef struct {
+	job_t job;
+	char * filename;
+	char * display_name;
+	char * cache_filename;  /* NULL if not using the chunk cache */
+	int is_written;  /* zero if another shard writes it */
+	gsflib_state_t * state;
+	buffer_t part_buf;  /* overlays: overlay_part_t, written instead of the whole program */
+} gsflib_job_t;
+
+/* an overlay is written as one file per span of differences, while its
+	state's program covers them all, the way a player sees it */
+typedef struct {
+	diff_span_t span;
+	char * filename;
+	char * display_name;
+} overlay_part_t;
+
+/* with --shard, the script is run in full by every shard, so that they all
+	have the same state. every output of the run gets the next index, and
+	only the shard that index falls to writes it */
+int is_shard_output()
+{
+	return shard_output_index++ % shard_count == shard_index;
+}
+
+pthread_mutex_t gsflib_state_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* frees a loaded ROM or a program made from one, which are reserved from
+	the memory budget for as long as they're allocated */
+void free_rom_buffer(buffer_t * buf)
+{
+	if (is_buffer_new(buf))
+		return;
+	release_memory(buf->max);
+	free_buffer(buf);
+}
+
+gsflib_state_t * new_gsflib_state()
+{
+	gsflib_state_t * state = malloc(sizeof(*state));
+	state->done = 0;
+	state->failed = 0;
+	state->dependent_buf = (buffer_t)DEFAULT_BUFFER_T;
+	state->program_buf = (buffer_t)DEFAULT_BUFFER_T;
+	state->program_refs = 0;
+	state->song_table_searched = 0;
+	state->song_table = (size_t)-1;
+	state->pending_job = NULL;
+	state->pending_report_size = 0;
+	state->blank_margin = 0;
+	state->used_id_buf = (buffer_t)DEFAULT_BUFFER_T;
+	state->next = gsflib_state_list;
+	gsflib_state_list = state;
+	return state;
+}
+
+/* marks the gsflib as finished. if it failed, the minigsfs that were
+	already written for it are removed, since they can't work without it */
+void finish_gsflib_state(gsflib_state_t * state, int failed, char * display_name)
+{
+	pthread_mutex_lock(&gsflib_state_mutex);
+	state->done = 1;
+	state->failed = failed;
+	buffer_t dependent_buf = state->dependent_buf;
+	state->dependent_buf = (buffer_t)DEFAULT_BUFFER_T;
+	pthread_mutex_unlock(&gsflib_state_mutex);
+	
+	size_t removed = 0;
+	for (size_t i = 0; i < dependent_buf.size; i += sizeof(char *))
+	{
+		char * path = *(char **)(dependent_buf.data + i);
+		if (failed && !remove(path))
+			removed++;
+		free(path);
+	}
+	free_buffer(&dependent_buf);
+	if (removed)
+		warn("Removed %zu .minigsfs using failed gsflib %s",removed,display_name);
+}
+
+/* called by a minigsf job after writing its file. returns nonzero if the
+	gsflib has failed, in which case the minigsf should be removed */
+int is_gsflib_failed(gsflib_state_t * state)
+{
+	if (!state)
+		return 0;
+	
+	pthread_mutex_lock(&gsflib_state_mutex);
+	int failed = state->failed;
+	pthread_mutex_unlock(&gsflib_state_mutex);
+	return failed;
+}
+
+int add_gsflib_dependent(gsflib_state_t * state, char * path)
+{
+	if (!state)
+		return 0;
+	
+	pthread_mutex_lock(&gsflib_state_mutex);
+	int failed = state->failed;
+	if (!state->done)
+	{
+		char * path_copy = strdup(path);
+		init_new_buffer(&state->dependent_buf, 0x40*sizeof(char *));
+		append_buffer(&state->dependent_buf, &path_copy, sizeof(path_copy));
+	}
+	pthread_mutex_unlock(&gsflib_state_mutex);
+	return failed;
+}
+
+void release_gsflib_program(gsflib_state_t * state)
+{
+	if (!state)
+		return;
+	
+	pthread_mutex_lock(&gsflib_state_mutex);
+	if (state->program_refs && !--state->program_refs)
+		free_rom_buffer(&state->program_buf);
+	pthread_mutex_unlock(&gsflib_state_mutex);
+}
+
+void free_gsflib_states()
+{
+	while (gsflib_state_list)
+	{
+		gsflib_state_t * next = gsflib_state_list->next;
+		free_buffer(&gsflib_state_list->dependent_buf);
+		free_rom_buffer(&gsflib_state_list->program_buf);
+		free_buffer(&gsflib_state_list->used_id_buf);
+		free(gsflib_state_list);
+		gsflib_state_list = next;
+	}
+}
+
+/* writes a whole gsf file, the tag section is optional. the program can be
+	given already compressed. a partially written file is removed. returns
+	nonzero on success */
+int write_gsf_file(char * filename, char * display_name, buffer_t * program_buf, buffer_t * tag_buf, int compressed)
+{
+	FILE * f = create_output_file(filename);
+	if (!f)
+	{
+		err("Can't open %s for writing (%s)",display_name,strerror(errno));
+		return 0;
+	}
+	
+	int ok;
+	if (compressed)
+		ok = write_gsf_compressed_data_to_file(f, program_buf->data, program_buf->size);
+	else
+		ok = write_gsf_data_to_file(f, program_buf->data, program_buf->size);
+	if (tag_buf)
+		fwrite(tag_buf->data,1,tag_buf->size,f);
+	ok &= !ferror(f);
+	ok &= fclose(f) == 0;
+	if (!ok)
+	{
+		err("Error while writing %s",display_name);
+		remove(filename);
+	}
+	return ok;
+}
+
+/* returns nonzero on success. on failure, the parts already written are
+	removed */
+int write_overlay_parts(gsflib_job_t * lib)
+{
+	uint8_t * program = lib->state->program_buf.data;
+	size_t program_start = read32(program+4) - read32(program+0);
+	buffer_t part_program_buf = DEFAULT_BUFFER_T;
+	size_t written = 0;
+	int ok = 1;
+	for (size_t i = 0; ok && i < lib->part_buf.size; i += sizeof(overlay_part_t))
+	{
+		overlay_part_t * part = lib->part_buf.data + i;
+		/* a gsflib has no tags, so an existing one is kept as it is */
+		if (retag_mode && is_gsf_file_valid(part->filename))
+			continue;
+		
+		size_t size = part->span.end - part->span.start;
+		init_new_buffer(&part_program_buf, 0xc + size);
+		expand_buffer(&part_program_buf, 0xc + size);
+		memcpy(part_program_buf.data, program, 4);
+		write32(part_program_buf.data+4, read32(program+0) + part->span.start);
+		write32(part_program_buf.data+8, size);
+		memcpy(part_program_buf.data+0xc, program + 0xc + part->span.start - program_start, size);
+		part_program_buf.size = 0xc + size;
+		ok = write_gsf_file(part->filename, part->display_name, &part_program_buf, NULL, 0);
+		written += ok;
+	}
+	free_buffer(&part_program_buf);
+	
+	for (size_t i = 0; !ok && written; i += sizeof(overlay_part_t), written--)
+		remove(((overlay_part_t *)(lib->part_buf.data + i))->filename);
+	return ok;
+}
+
+void run_gsflib_job(job_t * job)
+{
+	gsflib_job_t * lib = (gsflib_job_t *)job;
+	
+	int failed;
+	if (lib->is_written && lib->part_buf.size)
+	{
+		failed = !write_overlay_parts(lib);
+	}
+	else if (!lib->is_written || (retag_mode && is_gsf_file_valid(lib->filename)))
+	{ /* a gsflib has no tags, so an existing one is kept as it is */
+		failed = 0;
+		free(lib->cache_filename);
+	}
+	else if (lib->cache_filename)
+	{
+		buffer_t compressed_buf = DEFAULT_BUFFER_T;
+		failed = !compress_program_cached(lib->state->program_buf.data, lib->state->program_buf.size, lib->cache_filename, &compressed_buf);
+		if (!failed)
+			failed = !write_gsf_file(lib->filename, lib->display_name, &compressed_buf, NULL, 1);
+		free_buffer(&compressed_buf);
+		free(lib->cache_filename);
+	}
+	else
+	{
+		failed = !write_gsf_file(lib->filename, lib->display_name, &lib->state->program_buf, NULL, 0);
+	}
+	
+	finish_gsflib_state(lib->state, failed, lib->display_name);
+	release_gsflib_program(lib->state);
+	
+	for (size_t i = 0; i < lib->part_buf.size; i += sizeof(overlay_part_t))
+	{
+		overlay_part_t * part = lib->part_buf.data + i;
+		free(part->filename);
+		free(part->display_name);
+	}
+	free_buffer(&lib->part_buf);
+	free(lib->filename);
+	free(lib->display_name);
+}
+
+/* returns the size of a ROM without its trailing padding, rounded up to the
+	alignment. the padding byte is the last byte of the ROM, if it's $00 or
+	$FF. the scan goes 8 bytes at a time */
+size_t get_trimmed_rom_size(uint8_t * rom, size_t size, unsigned alignment)
+{
+	if (!size || (rom[size-1] != 0x00 && rom[size-1] != 0xff))
+		return size;
+	
+	uint64_t fill_word;
+	memset(&fill_word, rom[size-1], sizeof(fill_word));
+	size_t end = size;
+	while (end % sizeof(uint64_t) && rom[end-1] == rom[size-1])
+		end--;
+	if (!(end % sizeof(uint64_t)))
+	{
+		while (end)
+		{
+			uint64_t word;
+			memcpy(&word, rom+end-sizeof(word), sizeof(word));
+			if (word != fill_word)
+				break;
+			end -= sizeof(word);
+		}
+		while (end && rom[end-1] == rom[size-1])
+			end--;
+	}
+	
+	if (alignment > 1)
+		end = (end + alignment-1) / alignment * alignment;
+	return end < size ? end : size;
+}
+
+/* reads a ROM into a program buffer, preceded by the GSF program header */
+/* ROMs can also be read from gzip files, or from an entry of a zip file.
+	they are inflated from the mapped file straight into the program buffer,
+	and their CRC is checked on the way. nothing bigger than the GBA's ROM
+	space is inflated, whatever size the file claims */
+#define MAX_ROM_SIZE 0x2000000
+#define ZIP_LOCAL_HEADER 0x04034b50
+#define ZIP_CENTRAL_HEADER 0x02014b50
+#define ZIP_END_HEADER 0x06054b50
+
+int is_gzip_file(uint8_t * data, size_t size)
+{
+	return size >= 18 && data[0] == 0x1f && data[1] == 0x8b;
+}
+
+int is_zip_file(uint8_t * data, size_t size)
+{
+	return size >= 22 && read32(data) == ZIP_LOCAL_HEADER;
+}
+
+/* appends the inflated data to out_buf. zlib checks the CRC and size of
+	each gzip member itself */
+int inflate_gzip_rom(char * inname, uint8_t * data, size_t size, buffer_t * out_buf)
+{
+	z_stream zs;
+	memset(&zs,0,sizeof(zs));
+	if (inflateInit2(&zs, 16+MAX_WBITS) != Z_OK)
+	{
+		err("Error initializing zlib");
+		return 0;
+	}
+	
+	/* the size of the last member is a good guess for the whole */
+	size_t start = out_buf->size;
+	size_t guess = read32(data+size-4);
+	expand_buffer(out_buf, start + (guess < MAX_ROM_SIZE ? guess : MAX_ROM_SIZE) + 1);
+	zs.next_in = data;
+	zs.avail_in = size;
+	int status;
+	while (1)
+	{
+		if (out_buf->size == out_buf->max)
+			expand_buffer(out_buf, out_buf->max*2);
+		zs.next_out = out_buf->data + out_buf->size;
+		zs.avail_out = out_buf->max - out_buf->size;
+		status = inflate(&zs, Z_NO_FLUSH);
+		out_buf->size = out_buf->max - zs.avail_out;
+		if (out_buf->size - start > MAX_ROM_SIZE)
+		{
+			inflateEnd(&zs);
+			err("%s is larger than a GBA ROM can be",inname);
+			return 0;
+		}
+		if (status == Z_STREAM_END)
+		{ /* a gzip file can have several members */
+			if (zs.avail_in < 2 || zs.next_in[0] != 0x1f || zs.next_in[1] != 0x8b)
+				break;
+			inflateReset(&zs);
+		}
+		else if (status != Z_OK && status != Z_BUF_ERROR)
+			break;
+		else if (status == Z_BUF_ERROR && !zs.avail_in)
+			break;
+	}
+	inflateEnd(&zs);
+	if (status != Z_STREAM_END)
+	{
+		err("%s is not a valid gzip file (%s)",inname,zs.msg ? zs.msg : "truncated");
+		return 0;
+	}
+	return 1;
+}
+
+int is_gba_name(char * name, size_t name_len)
+{
+	static const char ext[] = ".gba";
+	if (name_len < 4)
+		return 0;
+	for (size_t i = 0; i < 4; i++)
+	{
+		if (tolower((uint8_t)name[name_len-4+i]) != ext[i])
+			return 0;
+	}
+	return 1;
+}
+
+/* appends the inflated entry to out_buf. without an entry name, the first
+	.gba file is used, or the only file */
+int inflate_zip_rom(char * inname, char * entry, uint8_t * data, size_t size, buffer_t * out_buf)
+{
+	/** find the central directory **/
+	size_t end = size - 22;
+	size_t end_min = size > 22 + 0xffff ? size - 22 - 0xffff : 0;
+	while (read32(data+end) != ZIP_END_HEADER)
+	{
+		if (end == end_min)
+		{
+			err("%s is not a valid zip file",inname);
+			return 0;
+		}
+		end--;
+	}
+	unsigned entry_count = read16(data+end+10);
+	size_t dir = read32(data+end+16);
+	
+	/** look for the entry **/
+	uint8_t * found = NULL;
+	size_t file_count = 0;
+	uint8_t * only_file = NULL;
+	for (unsigned i = 0; i < entry_count; i++)
+	{
+		if (dir + 46 > end || read32(data+dir) != ZIP_CENTRAL_HEADER)
+		{
+			err("%s has a broken zip directory",inname);
+			return 0;
+		}
+		uint8_t * header = data + dir;
+		size_t name_len = read16(header+28);
+		char * name = (char *)header + 46;
+		dir += 46 + name_len + read16(header+30) + read16(header+32);
+		if (dir > end)
+		{
+			err("%s has a broken zip directory",inname);
+			return 0;
+		}
+		if (!name_len || name[name_len-1] == '/')  /* directory */
+			continue;
+		
+		if (entry)
+		{
+			if (strlen(entry) == name_len && !memcmp(name, entry, name_len))
+			{
+				found = header;
+				break;
+			}
+		}
+		else
+		{
+			file_count++;
+			only_file = header;
+			if (is_gba_name(name, name_len))
+			{
+				found = header;
+				break;
+			}
+		}
+	}
+	if (!found && !entry && file_count == 1)
+		found = only_file;
+	if (!found)
+	{
+		if (entry)
+			err("%s has no entry %s",inname,entry);
+		else
+			err("%s has no .gba file, and more than one other file",inname);
+		return 0;
+	}
+	
+	/** find its data **/
+	unsigned method = read16(found+10);
+	uint32_t crc = read32(found+16);
+	size_t compressed_size = read32(found+20);
+	size_t uncompressed_size = read32(found+24);
+	size_t local = read32(found+42);
+	if (local + 30 > size || read32(data+local) != ZIP_LOCAL_HEADER)
+	{
+		err("%s has a broken zip entry",inname);
+		return 0;
+	}
+	local += 30 + read16(data+local+26) + read16(data+local+28);
+	if (read16(found+6) & 1)
+	{
+		err("%s has an encrypted entry",inname);
+		return 0;
+	}
+	if (compressed_size > size || local > size - compressed_size)
+	{
+		err("%s has a broken zip entry",inname);
+		return 0;
+	}
+	
+	if (uncompressed_size > MAX_ROM_SIZE)
+	{
+		err("%s is larger than a GBA ROM can be",inname);
+		return 0;
+	}
+	
+	size_t start = out_buf->size;
+	expand_buffer(out_buf, start + uncompressed_size);
+	if (method == 0)
+	{ /* stored */
+		if (compressed_size != uncompressed_size)
+		{
+			err("%s has a broken zip entry",inname);
+			return 0;
+		}
+		memcpy(out_buf->data + start, data + local, uncompressed_size);
+	}
+	else if (method == 8)
+	{ /* deflated */
+		z_stream zs;
+		memset(&zs,0,sizeof(zs));
+		if (inflateInit2(&zs, -MAX_WBITS) != Z_OK)
+		{
+			err("Error initializing zlib");
+			return 0;
+		}
+		zs.next_in = data + local;
+		zs.avail_in = compressed_size;
+		zs.next_out = out_buf->data + start;
+		zs.avail_out = uncompressed_size;
+		int status = inflate(&zs, Z_FINISH);
+		size_t total_out = zs.total_out;
+		inflateEnd(&zs);
+		if (status != Z_STREAM_END || total_out != uncompressed_size)
+		{
+			err("Error while inflating %s",inname);
+			return 0;
+		}
+	}
+	else
+	{
+		err("%s uses an unsupported zip compression method (%u)",inname,method);
+		return 0;
+	}
+	
+	if (get_program_crc32(out_buf->data + start, uncompressed_size) != crc)
+	{
+		err("CRC mismatch in %s",inname);
+		return 0;
+	}
+	out_buf->size = start + uncompressed_size;
+	return 1;
+}
+
+/* entry names the file to use in a zip file, and may be NULL. the loaded
+	ROM is freed with free_rom_buffer */
+int load_rom(char * inname, char * entry, unsigned rom_entry_point, buffer_t * out_buf)
+{
+	char * path = make_script_path(inname, 0);
+	if (!path)
+		return 0;
+	size_t size;
+	uint8_t * data = map_file(path, &size);
+	free(path);
+	if (!data)
+	{
+		err("Can't open %s for reading (%s)",inname,strerror(errno));
+		return 0;
+	}
+	
+	/* the file and the ROM are both held while loading */
+	int is_compressed = is_gzip_file(data, size) || is_zip_file(data, size);
+	size_t load_memory = size + (is_compressed ? get_inflate_memory(size) : size*2 + 0x10000);
+	reserve_memory(load_memory);
+	
+	init_buffer(out_buf,0x10000);
+	write32(out_buf->data+0, rom_entry_point);
+	write32(out_buf->data+4, rom_entry_point);
+	out_buf->size = 0xc;
+	int ok = 1;
+	if (is_gzip_file(data, size))
+	{
+		ok = inflate_gzip_rom(inname, data, size, out_buf);
+	}
+	else if (is_zip_file(data, size))
+	{
+		ok = inflate_zip_rom(inname, entry, data, size, out_buf);
+	}
+	else
+	{
+		if (entry)
+			warn("%s is not a zip file, entry %s ignored",inname,entry);
+		append_buffer(out_buf, data, size);
+	}
+	unmap_file(data, size);
+	release_memory(load_memory);
+	if (!ok)
+	{
+		free_buffer(out_buf);
+		return 0;
+	}
+	reserve_memory(out_buf->max);
+	
+	if (trim_rom_alignment)
+	{
+		uint8_t * rom = out_buf->data + 0xc;
+		size_t rom_size = out_buf->size - 0xc;
+		size_t trimmed_size = get_trimmed_rom_size(rom, rom_size, trim_rom_alignment);
+		if (trimmed_size < rom_size)
+		{
+			warn("Trimmed %zu bytes of $%02X padding from %s",rom_size-trimmed_size,rom[rom_size-1],inname);
+			out_buf->size = 0xc + trimmed_size;
+		}
+	}
+	write32(out_buf->data+8, out_buf->size-0xc);
+	
+	return 1;
+}
+
+gsflib_t * get_gsflib(char * name)
+{
+	for (size_t i = 0; i < gsflib_buf.size; i += sizeof(gsflib_t))
+	{
+		gsflib_t * cmp_lib = gsflib_buf.data + i;
+		if (!strcmp(name,cmp_lib->name_buf.data))
+			return cmp_lib;
+	}
+	return NULL;
+}
+
+/* the script keeps a reference to the active overlay's program, so that
+	patches can be diffed against the ROM as a player would see it. the
+	overlay's files are loaded with _lib2 onwards, and their spans are kept
+	as addresses to check minigsfs against */
+void use_gsflib_overlay(gsflib_state_t * state, char ** names, diff_span_t * spans, unsigned count)
+{
+	release_gsflib_program(active_overlay_state);
+	active_overlay_state = state;
+	char tag_name[0x10];
+	for (unsigned i = 0; i < overlay_lib_count; i++)
+	{
+		snprintf(tag_name, 0x10, "_lib%u", i+2);
+		set_gsf_tag(tag_name, NULL);
+	}
+	for (unsigned i = 0; i < count; i++)
+	{
+		snprintf(tag_name, 0x10, "_lib%u", i+2);
+		set_gsf_tag(tag_name, names[i]);
+	}
+	overlay_lib_count = count;
+	
+	overlay_span_buf.size = 0;
+	for (unsigned i = 0; i < count; i++)
+	{
+		diff_span_t span = {entry_point + spans[i].start, entry_point + spans[i].end};
+		init_new_buffer(&overlay_span_buf, 0x10*sizeof(diff_span_t));
+		append_buffer(&overlay_span_buf, &span, sizeof(span));
+	}
+}
+
+/* returns nonzero if a file of the active overlay covers any of the given
+	addresses. those files are loaded after a minigsf's own program, and
+	would overwrite it */
+int is_under_overlay(size_t start, size_t end)
+{
+	for (size_t i = 0; i < overlay_span_buf.size; i += sizeof(diff_span_t))
+	{
+		diff_span_t * span = overlay_span_buf.data + i;
+		if (start < span->end && end > span->start)
+			return 1;
+	}
+	return 0;
+}
+
+/* makes the given gsflib the one used by subsequent minigsfs */
+void use_gsflib(char * name)
+{
+	gsflib_t * lib = get_gsflib(name);
+	if (lib)
+		entry_point = lib->entry_point;
+	active_gsflib_state = lib ? lib->state : NULL;
+	set_gsf_tag("_lib", name);
+	
+	/* overlays only apply to the gsflib they were made against */
+	use_gsflib_overlay(NULL, NULL, NULL, 0);
+}
+
+/* a gsflib's compressibility report measures what each region of the ROM
+	costs on its own when compressed, so that it's clear where blanking
+	unused data pays off. the regions are compressed as separate jobs, and
+	the last one to finish writes the report */
+#define REPORT_PADDING_RUN 0x20
+#define REPORT_HEATMAP_WIDTH 64
+
+enum {
+	REGION_PADDING = 1,
+	REGION_PCM = 2,
+	REGION_GRAPHICS = 4
+};
+
+typedef struct {
+	size_t in_size;
+	size_t out_size;
+	size_t padding_size;  /* bytes in runs of $00 or $FF */
+	unsigned flags;
+} region_report_t;
+
+typedef struct {
+	char * filename;
+	char * display_name;
+	gsflib_state_t * state;
+	size_t region_size;
+	size_t region_count;
+	region_report_t * regions;
+	size_t pending;  /* regions not measured yet */
+	int failed;
+} gsflib_report_t;
+
+typedef struct {
+	job_t job;
+	gsflib_report_t * report;
+	size_t region;
+} report_job_t;
+
+pthread_mutex_t report_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+size_t get_padding_size(uint8_t * data, size_t size)
+{
+	size_t padding = 0;
+	size_t i = 0;
+	while (i < size)
+	{
+		size_t run = 1;
+		while (i+run < size && data[i+run] == data[i])
+			run++;
+		if ((data[i] == 0x00 || data[i] == 0xff) && run >= REPORT_PADDING_RUN)
+			padding += run;
+		i += run;
+	}
+	return padding;
+}
+
+/* 4bpp tiles use both nibbles of a byte the same way, while code and most
+	other data don't, so similar and well-spread nibble statistics point to
+	graphics. it's only a guess */
+int is_likely_graphics(uint8_t * data, size_t size)
+{
+	unsigned low_count[0x10] = {0};
+	unsigned high_count[0x10] = {0};
+	for (size_t i = 0; i < size; i++)
+	{
+		low_count[data[i] & 0xf]++;
+		high_count[data[i] >> 4]++;
+	}
+	double low_entropy = get_entropy(low_count, 0x10, size);
+	double high_entropy = get_entropy(high_count, 0x10, size);
+	return low_entropy > 2.0 && high_entropy > 2.0 && fabs(low_entropy - high_entropy) < 0.25;
+}
+
+void write_gsflib_report(gsflib_report_t * report)
+{
+	uint8_t * program = report->state->program_buf.data;
+	unsigned address = read32(program+4);
+	size_t total_in = 0;
+	size_t total_out = 0;
+	for (size_t i = 0; i < report->region_count; i++)
+	{
+		total_in += report->regions[i].in_size;
+		total_out += report->regions[i].out_size;
+	}
+	
+	FILE * f = fopen(report->filename,"wb");
+	if (!f)
+	{
+		err("Can't open report for %s for writing (%s)",report->display_name,strerror(errno));
+		return;
+	}
+	fprintf(f,"{\n\t\"address\": %u,\n\t\"region_size\": %zu,\n",address,report->region_size);
+	fprintf(f,"\t\"bytes_in\": %zu,\n\t\"bytes_out\": %zu,\n",total_in,total_out);
+	fprintf(f,"\t\"regions\": [\n");
+	for (size_t i = 0; i < report->region_count; i++)
+	{
+		region_report_t * region = &report->regions[i];
+		fprintf(f,"\t\t{\"address\": %zu, \"bytes_in\": %zu, \"bytes_out\": %zu, \"ratio\": %.4f, \"padding\": %zu, \"flags\": [",
+			address + i*report->region_size, region->in_size, region->out_size,
+			(double)region->out_size / region->in_size, region->padding_size);
+		const char * sep = "";
+		if (region->flags & REGION_PADDING) { fprintf(f,"%s\"padding\"",sep); sep = ", "; }
+		if (region->flags & REGION_PCM) { fprintf(f,"%s\"pcm\"",sep); sep = ", "; }
+		if (region->flags & REGION_GRAPHICS) { fprintf(f,"%s\"graphics\"",sep); sep = ", "; }
+		fprintf(f,"]}%s\n", i+1 < report->region_count ? "," : "");
+	}
+	fprintf(f,"\t]\n}\n");
+	int ok = !ferror(f);
+	ok &= fclose(f) == 0;
+	if (!ok)
+	{
+		err("Error while writing report for %s",report->display_name);
+		remove(report->filename);
+		return;
+	}
+	
+	/* the heatmap goes out as one message, so other threads can't split it */
+	static const char shades[] = " .:-=+*#%@";
+	buffer_t map_buf = DEFAULT_BUFFER_T;
+	init_buffer(&map_buf, 0x100);
+	for (size_t i = 0; i < report->region_count; i++)
+	{
+		if (!(i % REPORT_HEATMAP_WIDTH))
+		{
+			char row[0x20];
+			size_t written = snprintf(row, 0x20, "\n%08zX ", address + i*report->region_size);
+			append_buffer(&map_buf, row, written);
+		}
+		region_report_t * region = &report->regions[i];
+		unsigned shade = (region->out_size * 10) / region->in_size;
+		append_buffer_char(&map_buf, shades[shade < 10 ? shade : 9]);
+	}
+	append_buffer_char(&map_buf, '\0');
+	warn("%s: %zu bytes compress to %zu (%.1f%%), one column per $%zX bytes, \"%s\" = 0%%-100%%%s",
+		report->display_name, total_in, total_out, total_in ? total_out * 100.0 / total_in : 0.0,
+		report->region_size, shades, (char *)map_buf.data);
+	free_buffer(&map_buf);
+}
+
+void run_report_job(job_t * job)
+{
+	report_job_t * region_job = (report_job_t *)job;
+	gsflib_report_t * report = region_job->report;
+	region_report_t * region = &report->regions[region_job->region];
+	
+	uint8_t * data = report->state->program_buf.data + 0xc + region_job->region*report->region_size;
+	region->in_size = report->state->program_buf.size - 0xc - region_job->region*report->region_size;
+	if (region->in_size > report->region_size)
+		region->in_size = report->region_size;
+	
+	buffer_t out_buf = DEFAULT_BUFFER_T;
+	int failed = !compress_program(data, region->in_size, &out_buf);
+	region->out_size = out_buf.size;
+	free_buffer(&out_buf);
+	
+	region->padding_size = get_padding_size(data, region->in_size);
+	region->flags = 0;
+	if (region->padding_size*2 >= region->in_size)
+		region->flags |= REGION_PADDING;
+	else if (get_block_params(data, region->in_size).level != Z_BEST_COMPRESSION)
+		region->flags |= REGION_PCM;
+	else if (is_likely_graphics(data, region->in_size))
+		region->flags |= REGION_GRAPHICS;
+	
+	pthread_mutex_lock(&report_mutex);
+	report->failed |= failed;
+	int last = !--report->pending;
+	pthread_mutex_unlock(&report_mutex);
+	if (!last)
+		return;
+	
+	if (!report->failed)
+		write_gsflib_report(report);
+	release_gsflib_program(report->state);
+	free(report->filename);
+	free(report->display_name);
+	free(report->regions);
+	free(report);
+}
+
+/* takes a reference to the gsflib's program */
+void queue_gsflib_report(gsflib_state_t * state, char * gsflib_filename, char * display_name, unsigned region_size)
+{
+	size_t rom_size = state->program_buf.size - 0xc;
+	if (!rom_size)
+	{
+		release_gsflib_program(state);
+		return;
+	}
+	
+	gsflib_report_t * report = malloc(sizeof(*report));
+	report->filename = malloc(strlen(gsflib_filename)+sizeof(".report.json"));
+	strcpy(report->filename, gsflib_filename);
+	strcat(report->filename, ".report.json");
+	report->display_name = strdup(display_name);
+	report->state = state;
+	report->region_size = region_size;
+	report->region_count = (rom_size + region_size-1) / region_size;
+	report->regions = malloc(report->region_count * sizeof(*report->regions));
+	report->pending = report->region_count;
+	report->failed = 0;
+	
+	for (size_t i = 0; i < report->region_count; i++)
+	{
+		report_job_t * region_job = malloc(sizeof(*region_job));
+		region_job->report = report;
+		region_job->region = i;
+		submit_job(&region_job->job, run_report_job, get_compress_memory(region_size));
+	}
+}
+
+/* the report is queued after the gsflib itself, which takes the longest */
+void submit_gsflib_job(gsflib_job_t * lib, unsigned report_size)
+{
+	gsflib_state_t * state = lib->state;
+	char * filename = report_size ? strdup(lib->filename) : NULL;
+	char * display_name = report_size ? strdup(lib->display_name) : NULL;
+	submit_job(&lib->job, run_gsflib_job, get_compress_memory(state->program_buf.size));
+	
+	if (report_size)
+	{
+		queue_gsflib_report(state, filename, display_name, report_size);
+		free(filename);
+		free(display_name);
+	}
+}
+
+void make_gsflib(char * inname, char * outname, char * entry)
+{
+	if (get_gsflib(outname))
+	{
+		err("gsflib %s was already made",outname);
+		return;
+	}
+	gsflib_state_t * state = new_gsflib_state();
+	gsflib_t new_lib = {DEFAULT_BUFFER_T, entry_point, state};
+	set_buffer(&new_lib.name_buf, outname, strlen(outname)+1);
+	init_new_buffer(&gsflib_buf, 0x10*sizeof(gsflib_t));
+	append_buffer(&gsflib_buf, &new_lib, sizeof(new_lib));
+	
+	char * filename = make_script_path(outname, 0);
+	buffer_t in_buf = DEFAULT_BUFFER_T;
+	if (!filename || !load_rom(inname, entry, entry_point, &in_buf))
+	{
+		warn("No .minigsfs will be made for %s.",outname);
+		finish_gsflib_state(state, 1, outname);
+		free(filename);
+		return;
+	}
+	
+	/* one reference for the job, one for the script, and one for the
+		report if there is one */
+	int is_written = is_shard_output();
+	unsigned report_size = is_written ? report_region_size : 0;
+	state->program_buf = in_buf;
+	state->program_refs = report_size ? 3 : 2;
+	
+	/* the compression is the slow part, leave it to the thread pool */
+	gsflib_job_t * lib = malloc(sizeof(*lib));
+	lib->filename = filename;
+	lib->display_name = strdup(outname);
+	lib->cache_filename = NULL;
+	lib->is_written = is_written;
+	lib->part_buf = (buffer_t)DEFAULT_BUFFER_T;
+	if (use_chunk_cache && is_written)
+	{
+		lib->cache_filename = malloc(strlen(lib->filename)+sizeof(".cache"));
+		strcpy(lib->cache_filename, lib->filename);
+		strcat(lib->cache_filename, ".cache");
+	}
+	lib->state = state;
+	if (blank_song_margin)
+	{
+		state->pending_job = lib;
+		state->pending_report_size = report_size;
+		state->blank_margin = blank_song_margin;
+		return;
+	}
+	submit_gsflib_job(lib, report_size);
+}
+
+/* equal aligned blocks of two ROMs are skipped with memcmp, which the C
+	library vectorizes, and only a differing block is searched byte by byte */
+#define DIFF_BLOCK_SIZE 0x40
+
+/* spans closer than this are merged, since a separate file costs more than
+	the unchanged bytes in between */
+#define PATCH_MERGE_GAP 0x40
+
+/* appends a span of differing bytes, merging it with the previous one if
+	the gap between them is small */
+void add_diff_span(buffer_t * span_buf, size_t start, size_t end, size_t gap)
+{
+	init_new_buffer(span_buf, 0x10*sizeof(diff_span_t));
+	if (span_buf->size)
+	{
+		diff_span_t * last = span_buf->data + span_buf->size - sizeof(diff_span_t);
+		if (start <= last->end + gap)
+		{
+			if (end > last->end)
+				last->end = end;
+			return;
+		}
+	}
+	diff_span_t span = {start, end};
+	append_buffer(span_buf, &span, sizeof(span));
+}
+
+/* finds all spans of differing bytes between start and end */
+void find_diff_spans(uint8_t * a, uint8_t * b, size_t start, size_t end, size_t gap, buffer_t * span_buf)
+{
+	size_t i = start;
+	while (i < end)
+	{
+		if (!(i % DIFF_BLOCK_SIZE) && i + DIFF_BLOCK_SIZE <= end && !memcmp(a+i, b+i, DIFF_BLOCK_SIZE))
+		{
+			i += DIFF_BLOCK_SIZE;
+		}
+		else if (a[i] == b[i])
+		{
+			i++;
+		}
+		else
+		{
+			size_t run_start = i;
+			while (i < end && a[i] != b[i])
+				i++;
+			add_diff_span(span_buf, run_start, i, gap);
+		}
+	}
+}
+
+/* makes a gsflib holding only the part of a variant ROM that differs from
+	the active gsflib's ROM, to be loaded on top of it as _lib2 */
+void make_gsflib_overlay(char * inname, char * outname, char * entry)
+{
+	gsflib_state_t * base_state = active_gsflib_state;
+	if (!base_state || is_buffer_new(&base_state->program_buf))
+	{
+		err("Overlays need a gsflib made by MakeGSFLib");
+		return;
+	}
+	if (base_state->pending_job)
+	{
+		err("Overlays can't be made for a gsflib with unused songs blanked");
+		return;
+	}
+	if (get_gsflib(outname))
+	{
+		err("gsflib %s was already made",outname);
+		return;
+	}
+	
+	char * filename = make_script_path(outname, 0);
+	if (!filename)
+		return;
+	buffer_t variant_buf = DEFAULT_BUFFER_T;
+	if (!load_rom(inname, entry, entry_point, &variant_buf))
+	{
+		free(filename);
+		return;
+	}
+	
+	uint8_t * base_rom = base_state->program_buf.data + 0xc;
+	size_t base_size = base_state->program_buf.size - 0xc;
+	uint8_t * variant_rom = variant_buf.data + 0xc;
+	size_t variant_size = variant_buf.size - 0xc;
+	
+	if (variant_size < base_size)
+		warn("%s is smaller than the gsflib ROM, the rest of the gsflib ROM will remain",inname);
+	
+	buffer_t span_buf = DEFAULT_BUFFER_T;
+	size_t common_size = variant_size < base_size ? variant_size : base_size;
+	find_diff_spans(base_rom, variant_rom, 0, common_size, PATCH_MERGE_GAP, &span_buf);
+	if (variant_size > base_size)
+	{ /* past the end of the gsflib the player has zeroes */
+		uint8_t * zero = calloc(variant_size, 1);
+		find_diff_spans(zero, variant_rom, base_size, variant_size, PATCH_MERGE_GAP, &span_buf);
+		free(zero);
+	}
+	if (!span_buf.size)
+	{
+		warn("%s has no differences from the gsflib ROM, no overlay made",inname);
+		free_buffer(&span_buf);
+		free(filename);
+		free_rom_buffer(&variant_buf);
+		use_gsflib_overlay(NULL, NULL, NULL, 0);
+		return;
+	}
+	diff_span_t * spans = span_buf.data;
+	size_t span_count = span_buf.size / sizeof(diff_span_t);
+	size_t start = spans[0].start;
+	size_t end = spans[span_count-1].end;
+	
+	/* the program covers all the spans. where it's between them, it
+		matches the base, so it's what a player sees */
+	buffer_t overlay_buf = DEFAULT_BUFFER_T;
+	reserve_memory(0xc + end - start);
+	init_buffer(&overlay_buf, 0xc + end - start);
+	write32(overlay_buf.data+0, entry_point);
+	write32(overlay_buf.data+4, entry_point + start);
+	write32(overlay_buf.data+8, end - start);
+	memcpy(overlay_buf.data+0xc, variant_rom+start, end-start);
+	overlay_buf.size = 0xc + end - start;
+	free_rom_buffer(&variant_buf);
+	
+	/** the first span is written to the given name, the others beside it **/
+	buffer_t part_buf = DEFAULT_BUFFER_T;
+	init_buffer(&part_buf, span_count*sizeof(overlay_part_t));
+	char ** names = malloc(span_count*sizeof(char *));
+	char * ext = strrchr(outname, '.');
+	size_t stem_len = ext ? (size_t)(ext - outname) : strlen(outname);
+	size_t covered = 0;
+	size_t i;
+	for (i = 0; i < span_count; i++)
+	{
+		overlay_part_t part = {spans[i], NULL, NULL};
+		if (!i)
+		{
+			part.display_name = strdup(outname);
+		}
+		else
+		{
+			size_t name_size = stem_len + 0x20;
+			part.display_name = malloc(name_size);
+			snprintf(part.display_name, name_size, "%.*s.part%zu.gsflib", (int)stem_len, outname, i+1);
+		}
+		part.filename = make_script_path(part.display_name, 0);
+		if (!part.filename)
+		{
+			free(part.display_name);
+			break;
+		}
+		names[i] = part.display_name;
+		append_buffer(&part_buf, &part, sizeof(part));
+		
+		covered += spans[i].end - spans[i].start;
+	}
+	if (i < span_count)
+	{
+		free_buffer(&span_buf);
+		for (size_t j = 0; j < part_buf.size; j += sizeof(overlay_part_t))
+		{
+			overlay_part_t * part = part_buf.data + j;
+			free(part->filename);
+			free(part->display_name);
+		}
+		free_buffer(&part_buf);
+		free(names);
+		free(filename);
+		free_rom_buffer(&overlay_buf);
+		use_gsflib_overlay(NULL, NULL, NULL, 0);
+		return;
+	}
+	if (span_count > 1)
+		warn("Overlay %s covers $%zx-$%zx in %zu files (%zu of %zu bytes)",outname,start,end-1,span_count,covered,variant_size);
+	else
+		warn("Overlay %s covers $%zx-$%zx (%zu of %zu bytes)",outname,start,end-1,covered,variant_size);
+	
+	gsflib_state_t * state = new_gsflib_state();
+	state->program_buf = overlay_buf;
+	state->program_refs = 2;
+	
+	gsflib_job_t * lib = malloc(sizeof(*lib));
+	lib->filename = filename;
+	lib->display_name = strdup(outname);
+	lib->cache_filename = NULL;
+	lib->is_written = is_shard_output();
+	lib->state = state;
+	lib->part_buf = part_buf;
+	
+	/* the names belong to the job once it's submitted */
+	use_gsflib_overlay(state, names, spans, span_count);
+	free(names);
+	free_buffer(&span_buf);
+	submit_job(&lib->job, run_gsflib_job, get_compress_memory(state->program_buf.size));
+}
+
+
+
+
+
+
+
+/************************ MusicPlayer2000 ***************************/
+
+/* the MusicPlayer2000 (Sappy) sound driver keeps a table of song headers,
+	indexed by song ID. the table is found through the code of the
+	m4aSongNumStart family of functions, which load its address with a
+	pc-relative ldr, or failing that by looking for a long enough run of valid
+	table entries */
+#define SONG_TABLE_MIN_ENTRIES 4
+#define SONG_TABLE_MAX_TRACKS 16
+#define SONG_TABLE_MAX_PLAYERS 0x20
+#define SIGNATURE_ANY 0x100
+
+typedef struct {
+	uint16_t code[0x20];  /* SIGNATURE_ANY matches any byte */
+	size_t size;
+	size_t table_load_offset;  /* of the thumb ldr loading the table address */
+} song_table_signature_t;
+
+static const song_table_signature_t song_table_signatures[] = {
+	/* the start shared by m4aSongNumStart, m4aSongNumStartOrChange and
+		m4aSongNumStartOrContinue. they differ in where their literals are */
+	{{0x00,0xb5,0x00,0x04,SIGNATURE_ANY,0x4a,SIGNATURE_ANY,0x49,0x40,0x0b,0x40,0x18,0x83,0x88,0x59,0x00,
+		0xc9,0x18,0x89,0x00,0x89,0x18,0x0a,0x68,0x01,0x68}, 26, 6},
+};
+
+/* the ROM a song table scan is done on */
+typedef struct {
+	uint8_t * data;
+	size_t size;
+	unsigned address;
+} song_table_rom_t;
+
+int is_rom_pointer(song_table_rom_t * rom, unsigned pointer, size_t size)
+{
+	return pointer >= rom->address && pointer - rom->address <= rom->size && size <= rom->size - (pointer - rom->address);
+}
+
+/* returns the track count of the song header an entry points to, or -1 if
+	the entry isn't valid */
+int get_song_table_entry_tracks(song_table_rom_t * rom, size_t offset)
+{
+	if (offset + 8 > rom->size)
+		return -1;
+	unsigned header = read32(rom->data + offset);
+	unsigned player = rom->data[offset+4] | (rom->data[offset+5] << 8);
+	if (player >= SONG_TABLE_MAX_PLAYERS || !is_rom_pointer(rom, header, 8) || header & 3)
+		return -1;
+	
+	uint8_t * header_data = rom->data + header - rom->address;
+	unsigned tracks = header_data[0];
+	if (tracks > SONG_TABLE_MAX_TRACKS || !is_rom_pointer(rom, header + 8, tracks*4))
+		return -1;
+	if (tracks && !is_rom_pointer(rom, read32(header_data+4), 0xc))
+		return -1;
+	for (unsigned i = 0; i < tracks; i++)
+	{
+		if (!is_rom_pointer(rom, read32(header_data + 8 + i*4), 1))
+			return -1;
+	}
+	return tracks;
+}
+
+size_t count_song_table_entries(song_table_rom_t * rom, size_t offset)
+{
+	size_t count = 0;
+	while (get_song_table_entry_tracks(rom, offset + count*8) >= 0)
+		count++;
+	return count;
+}
+
+/* returns the ROM offset of the song table, or (size_t)-1 if none is found */
+size_t find_song_table(song_table_rom_t * rom)
+{
+	/* all signatures start with a push {lr}, so only the halfwords with that
+		are compared against all of them */
+	size_t signature_count = sizeof(song_table_signatures) / sizeof(*song_table_signatures);
+	for (size_t offset = 0; offset + 0x30 <= rom->size; offset += 2)
+	{
+		uint8_t * p = memchr(rom->data + offset, 0x00, rom->size - 0x30 - offset + 1);
+		if (!p)
+			break;
+		offset = p - rom->data;
+		if (offset & 1)
+		{
+			offset--;
+			continue;
+		}
+		if (p[1] != 0xb5)
+			continue;
+		for (size_t i = 0; i < signature_count; i++)
+		{
+			const song_table_signature_t * sig = &song_table_signatures[i];
+			size_t j;
+			for (j = 0; j < sig->size; j++)
+			{
+				if (sig->code[j] != SIGNATURE_ANY && sig->code[j] != p[j])
+					break;
+			}
+			if (j < sig->size)
+				continue;
+			
+			/* ldr rd,[pc,#imm*4] reads from the word-aligned address 4 bytes ahead */
+			size_t literal = ((offset + sig->table_load_offset + 4) & ~3) + p[sig->table_load_offset]*4;
+			if (literal + 4 > rom->size)
+				continue;
+			unsigned table = read32(rom->data + literal);
+			if (is_rom_pointer(rom, table, 8) && count_song_table_entries(rom, table - rom->address))
+				return table - rom->address;
+		}
+	}
+	
+	/* no driver code found, take the longest run of valid entries */
+	size_t best_offset = (size_t)-1;
+	size_t best_count = SONG_TABLE_MIN_ENTRIES - 1;
+	for (size_t offset = 0; offset + 8 <= rom->size; offset += 4)
+	{
+		size_t count = count_song_table_entries(rom, offset);
+		if (count > best_count)
+		{
+			best_offset = offset;
+			best_count = count;
+		}
+		if (count)
+			offset += (count-1) * 8;  /* the rest of a run can't start a longer one */
+	}
+	return best_offset;
+}
+
+/* the song table is only searched for once per gsflib */
+size_t get_gsflib_song_table(gsflib_state_t * state, song_table_rom_t * rom)
+{
+	rom->data = (uint8_t *)state->program_buf.data + 0xc;
+	rom->size = state->program_buf.size - 0xc;
+	rom->address = read32((uint8_t *)state->program_buf.data + 4);
+	if (!state->song_table_searched)
+	{
+		state->song_table = find_song_table(rom);
+		state->song_table_searched = 1;
+	}
+	return state->song_table;
+}
+
+/* a song's timing is found by walking the sequences of its tracks. the
+	driver runs at the frame rate, and at a tempo of 150 bpm it plays one
+	tick per frame */
+#define MP2K_FRAME_RATE 59.7275
+#define MP2K_DEFAULT_TEMPO 150
+#define MP2K_MAX_COMMANDS 0x100000
+#define MP2K_MAX_PATTERN_DEPTH 3
+#define MP2K_SONG_END_TAIL 1.0  /* seconds, for the last notes to ring out */
+#define MP2K_MAX_SAMPLE_SIZE 0x400000
+
+static const uint8_t mp2k_wait_lengths[0x31] = {
+	0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,16,17,18,19,20,21,22,23,24,
+	28,30,32,36,40,42,44,48,52,54,56,60,64,66,68,72,76,78,80,84,88,90,92,96
+};
+
+typedef struct {
+	unsigned tick;
+	unsigned tempo;  /* bpm */
+} tempo_event_t;
+
+typedef struct {
+	size_t offset;
+	unsigned tick;
+} track_visit_t;
+
+typedef struct {
+	int has_notes;
+	int loops;
+	unsigned end_tick;   /* where the track ends, or jumps back to its loop */
+	unsigned loop_tick;  /* where the loop starts */
+	uint8_t voices[0x80];  /* nonzero for each voice the track selects */
+} track_timing_t;
+
+typedef struct {
+	int has_notes;
+	int loops;
+	double intro;  /* seconds, the whole song if it doesn't loop */
+	double loop;   /* seconds */
+} song_timing_t;
+
+/* walks a track's sequence once, up to its end or its jump back to an
+	earlier point. the visit buffer is scratch space of the caller's. tempo
+	changes are added to the tempo buffer, and if there is a coverage map,
+	the bytes read are marked in it. returns zero if the sequence isn't
+	valid */
+int walk_mp2k_track(song_table_rom_t * rom, unsigned address, track_timing_t * timing, buffer_t * visit_buf, buffer_t * tempo_buf, uint8_t * coverage)
+{
+	init_new_buffer(visit_buf, 0x400*sizeof(track_visit_t));
+	visit_buf->size = 0;
+	
+	timing->has_notes = 0;
+	timing->loops = 0;
+	timing->loop_tick = 0;
+	memset(timing->voices, 0, sizeof(timing->voices));
+	timing->voices[0] = 1;  /* notes before the first voice command */
+	
+	size_t pos = address - rom->address;
+	size_t stack[MP2K_MAX_PATTERN_DEPTH];
+	unsigned depth = 0;
+	unsigned tick = 0;
+	unsigned repeat = 0;
+	uint8_t status = 0;
+	for (unsigned n = 0; n < MP2K_MAX_COMMANDS; n++)
+	{
+		if (pos + 8 > rom->size)
+			return 0;
+		uint8_t * p = rom->data;
+		if (!depth)
+		{
+			track_visit_t visit = {pos, tick};
+			append_buffer(visit_buf, &visit, sizeof(visit));
+		}
+		
+		/* a data byte in place of a command repeats the last command that
+			takes arguments, with that byte as the first argument */
+		size_t cmd_pos = pos;
+		uint8_t cmd = p[pos];
+		if (cmd < 0x80)
+		{
+			if (status < 0xbd)
+				return 0;
+			cmd = status;
+		}
+		else
+		{
+			pos++;
+			if (cmd >= 0xbd)
+				status = cmd;
+		}
+		
+		unsigned jump = 0;  /* ROM address to continue from, if nonzero */
+		int end = 0;
+		if (cmd <= 0xb0)
+		{ /* wait */
+			tick += mp2k_wait_lengths[cmd - 0x80];
+		}
+		else if (cmd == 0xb2 || (cmd == 0xb5 && !p[pos]))
+		{ /* goto, or repeat forever. going back to where the track has
+			already been is the loop */
+			if (cmd == 0xb5)
+				pos++;
+			jump = read32(p+pos);
+			pos += 4;
+			track_visit_t * visits = visit_buf->data;
+			for (size_t i = 0; i < visit_buf->size / sizeof(track_visit_t); i++)
+			{
+				if (visits[i].offset + rom->address == jump)
+				{
+					timing->loops = 1;
+					timing->loop_tick = visits[i].tick;
+					end = 1;
+					break;
+				}
+			}
+		}
+		else if (cmd == 0xb3)
+		{ /* pattern call */
+			if (depth == MP2K_MAX_PATTERN_DEPTH)
+				return 0;
+			jump = read32(p+pos);
+			pos += 4;
+			stack[depth++] = pos;
+		}
+		else if (cmd == 0xb4)
+		{ /* pattern end, ignored outside of patterns */
+			if (depth)
+				jump = stack[--depth] + rom->address;
+		}
+		else if (cmd == 0xb5)
+		{ /* repeat */
+			unsigned count = p[pos];
+			unsigned target = read32(p+pos+1);
+			pos += 5;
+			if (++repeat < count)
+				jump = target;
+			else
+				repeat = 0;
+		}
+		else if (cmd == 0xb9)
+		{ /* memacc */
+			pos += 3;
+		}
+		else if (cmd == 0xbb)
+		{ /* tempo */
+			tempo_event_t event = {tick, p[pos++] * 2};
+			append_buffer(tempo_buf, &event, sizeof(event));
+		}
+		else if (cmd == 0xbd)
+		{ /* voice */
+			timing->voices[p[pos++] & 0x7f] = 1;
+		}
+		else if ((cmd >= 0xba && cmd <= 0xc5) || cmd == 0xc8 || cmd == 0xcc)
+		{ /* commands with one argument */
+			pos++;
+		}
+		else if (cmd == 0xcd)
+		{ /* extended command */
+			pos += 2;
+		}
+		else if (cmd == 0xce)
+		{ /* end of tie, with an optional key */
+			if (p[pos] < 0x80)
+				pos++;
+		}
+		else if (cmd >= 0xcf)
+		{ /* notes, with optional key, velocity and (except ties) gate time */
+			timing->has_notes = 1;
+			for (int i = cmd == 0xcf ? 2 : 3; i && p[pos] < 0x80; i--)
+				pos++;
+		}
+		else
+		{ /* fine, and the unused commands that act like it */
+			end = 1;
+		}
+		
+		if (coverage)
+			memset(coverage + cmd_pos, 1, pos - cmd_pos);
+		if (end)
+		{
+			timing->end_tick = tick;
+			return 1;
+		}
+		if (jump)
+		{
+			if (!is_rom_pointer(rom, jump, 1))
+				return 0;
+			pos = jump - rom->address;
+		}
+	}
+	return 0;
+}
+
+int compare_tempo_events(const void * a, const void * b)
+{
+	const tempo_event_t * event_a = a;
+	const tempo_event_t * event_b = b;
+	return (event_a->tick > event_b->tick) - (event_a->tick < event_b->tick);
+}
+
+/* converts a tick count to seconds. past the end of the loop, the tempo
+	changes inside the loop happen again */
+double get_mp2k_seconds(tempo_event_t * events, size_t count, unsigned target, unsigned loop_tick, unsigned loop_ticks)
+{
+	size_t loop_index = 0;
+	while (loop_index < count && events[loop_index].tick < loop_tick)
+		loop_index++;
+	unsigned pass_end = loop_tick + loop_ticks;
+	
+	double seconds = 0;
+	unsigned tempo = MP2K_DEFAULT_TEMPO;
+	unsigned tick = 0;
+	unsigned base = 0;
+	size_t i = 0;
+	while (tick < target)
+	{
+		unsigned next = target;
+		if (i < count && (!loop_ticks || events[i].tick < pass_end) && base + events[i].tick < next)
+			next = base + events[i].tick;
+		if (loop_ticks && base + pass_end < next)
+			next = base + pass_end;
+		seconds += (next - tick) * (double)MP2K_DEFAULT_TEMPO / (tempo * MP2K_FRAME_RATE);
+		tick = next;
+		
+		if (loop_ticks && tick == base + pass_end)
+		{
+			base += loop_ticks;
+			i = loop_index;
+		}
+		while (i < count && (!loop_ticks || events[i].tick < pass_end) && base + events[i].tick == tick)
+		{
+			if (events[i].tempo)
+				tempo = events[i].tempo;
+			i++;
+		}
+	}
+	return seconds;
+}
+
+/* marks an instrument of a voice group and the data it uses. key split and
+	drum instruments are made of other instruments, so all of theirs are
+	marked */
+void mark_mp2k_voice(song_table_rom_t * rom, unsigned address, uint8_t * coverage, int depth)
+{
+	if (!is_rom_pointer(rom, address, 0xc))
+		return;
+	size_t offset = address - rom->address;
+	memset(coverage + offset, 1, 0xc);
+	uint8_t * voice = rom->data + offset;
+	unsigned pointer = read32(voice+4);
+	if (depth > 2)
+		return;
+	
+	if (voice[0] & 0x40)
+	{ /* key split: a voice group and a table of voice numbers by key */
+		unsigned key_table = read32(voice+8);
+		if (!is_rom_pointer(rom, key_table, 0x80))
+			return;
+		memset(coverage + key_table - rom->address, 1, 0x80);
+		uint8_t seen[0x100] = {0};
+		for (int key = 0; key < 0x80; key++)
+		{
+			uint8_t number = rom->data[key_table - rom->address + key];
+			if (!seen[number]++)
+				mark_mp2k_voice(rom, pointer + number*0xc, coverage, depth+1);
+		}
+	}
+	else if (voice[0] & 0x80)
+	{ /* drums: a voice group indexed by key */
+		for (int key = 0; key < 0x80; key++)
+			mark_mp2k_voice(rom, pointer + key*0xc, coverage, depth+1);
+	}
+	else if ((voice[0] & 7) == 0 && is_rom_pointer(rom, pointer, 0x10))
+	{ /* sample: a 16-byte header and the data, plus the byte after it. a
+		header that doesn't look right is left alone */
+		size_t sample = pointer - rom->address;
+		unsigned flags = read32(rom->data + sample);
+		size_t size = 0x10 + (size_t)read32(rom->data + sample + 0xc) + 1;
+		if ((flags & ~0x40000001u) || size > MP2K_MAX_SAMPLE_SIZE || size > rom->size - sample)
+			return;
+		memset(coverage + sample, 1, size);
+	}
+	else if ((voice[0] & 7) == 3 && is_rom_pointer(rom, pointer, 0x10))
+	{ /* wave channel: 32 4-bit samples */
+		memset(coverage + pointer - rom->address, 1, 0x10);
+	}
+}
+
+/* returns zero if the song table entry isn't a valid song. if there is a
+	coverage map, all the song's data is marked in it */
+int get_mp2k_song_timing(song_table_rom_t * rom, size_t table, unsigned id, unsigned loops, song_timing_t * timing, uint8_t * coverage)
+{
+	int tracks = get_song_table_entry_tracks(rom, table + (size_t)id*8);
+	if (tracks < 0)
+		return 0;
+	uint8_t * header = rom->data + read32(rom->data + table + (size_t)id*8) - rom->address;
+	if (coverage)
+		memset(coverage + (header - rom->data), 1, 8 + tracks*4);
+	
+	/* only run on the script's thread, so the buffers are reserved from the
+		budget as the tracks grow them */
+	buffer_t visit_buf = DEFAULT_BUFFER_T;
+	buffer_t tempo_buf = DEFAULT_BUFFER_T;
+	init_buffer(&tempo_buf, 0x40*sizeof(tempo_event_t));
+	size_t reserved = tempo_buf.max;
+	reserve_memory(reserved);
+	
+	unsigned end_tick = 0;
+	unsigned loop_tick = 0;
+	unsigned loop_ticks = 0;
+	timing->has_notes = 0;
+	timing->loops = 0;
+	for (int i = 0; i < tracks; i++)
+	{
+		track_timing_t track;
+		int walked = walk_mp2k_track(rom, read32(header + 8 + i*4), &track, &visit_buf, &tempo_buf, coverage);
+		if (visit_buf.max + tempo_buf.max > reserved)
+		{
+			reserve_memory(visit_buf.max + tempo_buf.max - reserved);
+			reserved = visit_buf.max + tempo_buf.max;
+		}
+		if (!walked)
+		{
+			free_buffer(&visit_buf);
+			free_buffer(&tempo_buf);
+			release_memory(reserved);
+			return 0;
+		}
+		if (coverage)
+		{
+			unsigned voice_group = read32(header+4);
+			for (int voice = 0; voice < 0x80; voice++)
+			{
+				if (track.voices[voice])
+					mark_mp2k_voice(rom, voice_group + voice*0xc, coverage, 0);
+			}
+		}
+		timing->has_notes |= track.has_notes;
+		if (track.loops && track.end_tick > track.loop_tick)
+		{
+			timing->loops = 1;
+			if (track.loop_tick > loop_tick)
+				loop_tick = track.loop_tick;
+			if (track.end_tick - track.loop_tick > loop_ticks)
+				loop_ticks = track.end_tick - track.loop_tick;
+		}
+		else if (track.end_tick > end_tick)
+		{
+			end_tick = track.end_tick;
+		}
+	}
+	
+	tempo_event_t * events = tempo_buf.data;
+	size_t count = tempo_buf.size / sizeof(tempo_event_t);
+	qsort(events, count, sizeof(*events), compare_tempo_events);
+	if (timing->loops)
+	{
+		timing->intro = get_mp2k_seconds(events, count, loop_tick, loop_tick, loop_ticks);
+		timing->loop = get_mp2k_seconds(events, count, loop_tick + loop_ticks*loops, loop_tick, loop_ticks) - timing->intro;
+		if (loops)
+			timing->loop /= loops;
+	}
+	else
+	{
+		timing->intro = get_mp2k_seconds(events, count, end_tick, 0, 0);
+		timing->loop = 0;
+	}
+	free_buffer(&visit_buf);
+	free_buffer(&tempo_buf);
+	release_memory(reserved);
+	return 1;
+}
+
+/* blanks the data used only by songs of the table that none of the
+	gsflib's minigsfs play: their headers, sequences, instruments and
+	samples. everything else, including the driver code and the song table
+	itself, is kept, as well as a margin around the data of played songs.
+	the played songs are then walked again on the blanked ROM, and if
+	anything they use changed, the ROM is restored */
+void blank_unused_song_data(gsflib_state_t * state, char * display_name)
+{
+	song_table_rom_t rom;
+	size_t table = get_gsflib_song_table(state, &rom);
+	if (table == (size_t)-1)
+	{
+		warn("Can't find a song table in %s, nothing blanked",display_name);
+		return;
+	}
+	size_t count = count_song_table_entries(&rom, table);
+	
+	uint8_t * is_played = calloc(count ? count : 1, 1);
+	unsigned * ids = state->used_id_buf.data;
+	for (size_t i = 0; i < state->used_id_buf.size / sizeof(unsigned); i++)
+	{
+		if (ids[i] >= count)
+		{
+			warn("Song ID %u is past the song table of %s, nothing blanked",ids[i],display_name);
+			free(is_played);
+			return;
+		}
+		is_played[ids[i]] = 1;
+	}
+	
+	/** mark the data of the played and the unplayed songs **/
+	uint8_t * played = calloc(rom.size, 1);
+	uint8_t * unplayed = calloc(rom.size, 1);
+	song_timing_t * timings = malloc((count ? count : 1) * sizeof(*timings));
+	size_t unplayed_count = 0;
+	int ok = 1;
+	for (size_t id = 0; id < count && ok; id++)
+	{
+		/* invalid songs are checked first, so a partial walk of them can't
+			mark anything */
+		song_timing_t timing;
+		int valid = get_mp2k_song_timing(&rom, table, id, 1, &timing, NULL);
+		if (is_played[id])
+		{
+			if (!valid)
+			{
+				warn("Song ID %zu of %s can't be followed, nothing blanked",id,display_name);
+				ok = 0;
+			}
+			else
+			{
+				get_mp2k_song_timing(&rom, table, id, 1, &timings[id], played);
+			}
+		}
+		else if (valid)
+		{
+			get_mp2k_song_timing(&rom, table, id, 1, &timing, unplayed);
+			unplayed_count++;
+		}
+	}
+	
+	/** blank what only unplayed songs use, away from the played data **/
+	size_t blanked = 0;
+	uint8_t * original = NULL;
+	if (ok)
+	{
+		original = malloc(rom.size);
+		memcpy(original, rom.data, rom.size);
+		size_t margin = state->blank_margin;
+		size_t last_played = (size_t)-1;
+		for (size_t i = 0; i < rom.size; i++)
+		{ /* mark the bytes up to the margin after played data */
+			if (played[i])
+				last_played = i;
+			else if (unplayed[i] && last_played != (size_t)-1 && i - last_played <= margin)
+				unplayed[i] = 0;
+		}
+		last_played = (size_t)-1;
+		for (size_t i = rom.size; i--; )
+		{
+			if (played[i])
+				last_played = i;
+			else if (unplayed[i] && (last_played == (size_t)-1 || last_played - i > margin))
+			{
+				rom.data[i] = 0;
+				blanked++;
+			}
+		}
+		
+		/** verify by walking the played songs again **/
+		uint8_t * check = calloc(rom.size, 1);
+		for (size_t id = 0; id < count && ok; id++)
+		{
+			song_timing_t timing;
+			if (!is_played[id])
+				continue;
+			if (!get_mp2k_song_timing(&rom, table, id, 1, &timing, check)
+				|| timing.has_notes != timings[id].has_notes || timing.loops != timings[id].loops
+				|| timing.intro != timings[id].intro || timing.loop != timings[id].loop)
+				ok = 0;
+		}
+		if (ok && memcmp(check, played, rom.size))
+			ok = 0;
+		free(check);
+		
+		if (!ok)
+		{
+			memcpy(rom.data, original, rom.size);
+			warn("Played songs of %s changed after blanking, nothing blanked",display_name);
+		}
+		else
+		{
+			warn("Blanked %zu bytes of data used only by %zu unplayed songs in %s",blanked,unplayed_count,display_name);
+		}
+	}
+	
+	free(original);
+	free(timings);
+	free(unplayed);
+	free(played);
+	free(is_played);
+}
+
+/* makes the gsflibs that were waiting for the end of the script */
+void submit_blanked_gsflibs()
+{
+	for (size_t i = 0; i < gsflib_buf.size; i += sizeof(gsflib_t))
+	{
+		gsflib_t * lib = gsflib_buf.data + i;
+		gsflib_state_t * state = lib->state;
+		if (!state->pending_job)
+			continue;
+		
+		gsflib_job_t * job = state->pending_job;
+		if (job->is_written)
+			blank_unused_song_data(state, lib->name_buf.data);
+		state->pending_job = NULL;
+		free_buffer(&state->used_id_buf);
+		submit_gsflib_job(job, state->pending_report_size);
+	}
+}
+
+
+
+
+
+
+
+
+/************************ minigsf-related **************************/
+
+/* a part of a patch that is too far from the song ID to fit in the
+	minigsf itself, written as its own file and loaded with a _libN tag */
+typedef struct {
+	char * filename;
+	char * display_name;
+	buffer_t program_buf;
+} minigsf_patch_t;
+
+typedef struct {
+	job_t job;
+	char * filename;
+	char * display_name;
+	buffer_t program_buf;
+	buffer_t patch_buf;  /* minigsf_patch_t */
+	buffer_t tag_buf;
+	gsflib_state_t * lib_state;
+	gsflib_state_t * overlay_state;
+} minigsf_job_t;
+
+/* returns nonzero if a gsflib failed and the file should be removed */
+int add_minigsf_dependent(minigsf_job_t * mini, char * path)
+{
+	return add_gsflib_dependent(mini->lib_state, path) | add_gsflib_dependent(mini->overlay_state, path);
+}
+
+void run_minigsf_job(job_t * job)
+{
+	minigsf_job_t * mini = (minigsf_job_t *)job;
+	
+	int ok = 1;
+	for (size_t i = 0; i < mini->patch_buf.size; i += sizeof(minigsf_patch_t))
+	{
+		minigsf_patch_t * patch = mini->patch_buf.data + i;
+		/* patches have no tags, an existing one is kept when retagging */
+		if (ok && !(retag_mode && is_gsf_file_valid(patch->filename)))
+		{
+			ok = write_gsf_file(patch->filename, patch->display_name, &patch->program_buf, NULL, 0);
+			if (ok && add_minigsf_dependent(mini, patch->filename))
+				remove(patch->filename);
+		}
+		free_buffer(&patch->program_buf);
+		free(patch->filename);
+		free(patch->display_name);
+	}
+	free_buffer(&mini->patch_buf);
+	
+	int retagged = 0;
+	if (ok && retag_mode)
+	{
+		retagged = retag_gsf_file(mini->filename, &mini->tag_buf);
+		if (retagged < 0)
+			err("Error while retagging %s",mini->display_name);
+		else if (!retagged)
+			warn("Can't retag %s, writing it in full",mini->display_name);
+	}
+	
+	/* an existing file that was retagged isn't removed if its gsflib fails */
+	if (ok && !retagged && write_gsf_file(mini->filename, mini->display_name, &mini->program_buf, &mini->tag_buf, 0))
+	{
+		if (add_minigsf_dependent(mini, mini->filename))
+		{ /* a gsflib failed before this was written */
+			remove(mini->filename);
+		}
+	}
+	
+	free_buffer(&mini->program_buf);
+	free_buffer(&mini->tag_buf);
+	free(mini->filename);
+	free(mini->display_name);
+}
+
+/* the filename template is compiled once by FilenameTemplate into a list of
+	operations, so a minigsf's filename is made in one pass. literals are
+	sanitized when the template is compiled, and tag values as they are
+	copied. a '/' in a literal separates directories, which are made when
+	the first file is written into them */
+enum {
+	FILENAME_LITERAL = 0,
+	FILENAME_SONG_NUMBER,
+	FILENAME_SONG_ID,
+	FILENAME_TAG
+};
+
+typedef struct {
+	int type;
+	unsigned width;  /* numbers: the minimum number of digits */
+	unsigned divisor;  /* numbers: the size of a bucket, 1 for the number itself */
+	size_t start;  /* literals: in filename_literal_buf */
+	size_t size;
+	const char * tag;
+	const char * tag_label;  /* for the warning if the tag isn't defined */
+} filename_op_t;
+
+void append_padded_number(buffer_t * buf, unsigned value, unsigned width)
+{
+	char digits[10];
+	unsigned count = 0;
+	do
+	{
+		digits[count++] = '0' + value % 10;
+		value /= 10;
+	} while (value);
+	for (; width > count; width--)
+		append_buffer_char(buf, '0');
+	while (count)
+		append_buffer_char(buf, digits[--count]);
+}
+
+void compile_filename_template(char * filename_template)
+{
+	free_buffer(&filename_op_buf);
+	free_buffer(&filename_literal_buf);
+	filename_template_error = 0;
+	init_buffer(&filename_op_buf, 0x10*sizeof(filename_op_t));
+	init_buffer(&filename_literal_buf, 0x100);
+	
+	size_t index = 0;
+	while (1)
+	{
+		char ch = filename_template[index];
+		if (ch == '\0')
+			break;
+		
+		filename_op_t op = {FILENAME_LITERAL, 0, 1, 0, 0, NULL, NULL};
+		if (ch != '%')
+		{ /* literal text up to the next conversion */
+			size_t size = strcspn(filename_template+index, "%");
+			op.start = filename_literal_buf.size;
+			append_sanitized(&filename_literal_buf, filename_template+index, size, 1);
+			op.size = filename_literal_buf.size - op.start;
+			index += size;
+		}
+		else
+		{ /* conversion code */
+			index++;
+			unsigned * number = &op.width;
+			while (1)
+			{
+				ch = filename_template[index++];
+				if (ch == '\0')
+				{
+					err("Incomplete conversion specifier in filename template");
+					filename_template_error = 1;
+					return;
+				}
+				else if (isdigit((uint8_t)ch))
+				{
+					unsigned digit = ch - '0';
+					*number *= 10;
+					*number += digit;
+				}
+				else if (ch == '/' && number == &op.width)
+				{ /* bucket size, for grouping numbers into directories */
+					number = &op.divisor;
+					op.divisor = 0;
+				}
+				else if (!op.divisor)
+				{
+					err("Bucket size in filename template must be nonzero");
+					filename_template_error = 1;
+					return;
+				}
+				else if (ch == 'n')
+				{ /* song number */
+					op.type = FILENAME_SONG_NUMBER;
+					break;
+				}
+				else if (ch == 'i')
+				{ /* song id */
+					op.type = FILENAME_SONG_ID;
+					break;
+				}
+				else if (op.divisor != 1)
+				{
+					err("Bucket size in filename template only applies to %%n and %%i");
+					filename_template_error = 1;
+					return;
+				}
+				else if (ch == 't')
+				{ /* title */
+					op.type = FILENAME_TAG;
+					op.tag = "title";
+					op.tag_label = "Title";
+					break;
+				}
+				else if (ch == 'a')
+				{ /* artist */
+					op.type = FILENAME_TAG;
+					op.tag = "artist";
+					op.tag_label = "Artist";
+					break;
+				}
+				else
+				{
+					err("Invalid conversion specifier '%.*s' in filename template",(int)get_utf8_char_size(filename_template+index-1),filename_template+index-1);
+					filename_template_error = 1;
+					return;
+				}
+			}
+		}
+		if (op.type != FILENAME_LITERAL || op.size)
+			append_buffer(&filename_op_buf, &op, sizeof(op));
+	}
+}
+
+/* makes the filename of the next minigsf from the compiled filename
+	template. returns NULL on error */
+char * make_minigsf_filename()
+{
+	if (!get_gsf_tag("_lib"))
+	{
+		err("gsflib filename not defined yet");
+		return NULL;
+	}
+	if (filename_template_error)  /* already reported */
+		return NULL;
+	if (is_buffer_new(&filename_op_buf))
+	{
+		err("Filename template not defined yet");
+		return NULL;
+	}
+	
+	static buffer_t filename_buf = DEFAULT_BUFFER_T;
+	init_new_buffer(&filename_buf, 0x200);
+	filename_buf.size = 0;
+	for (size_t i = 0; i < filename_op_buf.size; i += sizeof(filename_op_t))
+	{
+		filename_op_t * op = filename_op_buf.data + i;
+		switch (op->type)
+		{
+			case FILENAME_LITERAL:
+				append_buffer(&filename_buf, filename_literal_buf.data + op->start, op->size);
+				break;
+			case FILENAME_SONG_NUMBER:
+				append_padded_number(&filename_buf, song_number / op->divisor, op->width);
+				break;
+			case FILENAME_SONG_ID:
+				append_padded_number(&filename_buf, song_id / op->divisor, op->width);
+				break;
+			case FILENAME_TAG:
+			{
+				gsf_tag_t * tag = get_gsf_tag((char *)op->tag);
+				if (tag && !is_buffer_new(&tag->value_buf))
+					append_sanitized(&filename_buf, tag->value_buf.data, tag->value_buf.size-1, 0);
+				else
+					warn("%s conversion specifier requested, but is not defined",op->tag_label);
+				break;
+			}
+		}
+	}
+	append_buffer_char(&filename_buf,'\0');
+	
+	/* every directory and the file itself need a name, and the files stay
+		below the script's directory */
+	char * component = filename_buf.data;
+	while (1)
+	{
+		size_t len = strcspn(component, "/");
+		if (!len || (len == 1 && component[0] == '.') || (len == 2 && !memcmp(component,"..",2)))
+		{
+			err("Filename template made the invalid path %s",(char *)filename_buf.data);
+			return NULL;
+		}
+		if (!component[len])
+			break;
+		component += len + 1;
+	}
+	
+	return filename_buf.data;
+}
+
+void format_tag_seconds(char * out, size_t size, double seconds)
+{
+	unsigned ms = seconds * 1000 + 0.5;
+	if (ms >= 60000)
+		snprintf(out, size, "%u:%02u.%03u", ms / 60000, ms / 1000 % 60, ms % 1000);
+	else
+		snprintf(out, size, "%u.%03u", ms / 1000, ms % 1000);
+}
+
+/* with AutoLength on, the length and fade of the song are worked out from
+	its sequence data and used instead of the current tags. returns zero if
+	the song couldn't be analyzed */
+int get_auto_length(char * length, char * fade, size_t size)
+{
+	gsflib_state_t * state = active_gsflib_state;
+	if (!state || is_buffer_new(&state->program_buf))
+	{
+		err("AutoLength needs a gsflib made by MakeGSFLib");
+		return 0;
+	}
+	song_table_rom_t rom;
+	size_t table = get_gsflib_song_table(state, &rom);
+	if (table == (size_t)-1)
+	{
+		err("AutoLength can't find a song table");
+		return 0;
+	}
+	
+	song_timing_t timing;
+	if (!get_mp2k_song_timing(&rom, table, song_id, auto_length_loops, &timing, NULL))
+	{
+		warn("Song ID %u is not a valid song, length not set",song_id);
+		return 0;
+	}
+	if (!timing.has_notes)
+		warn("Song ID %u has no notes",song_id);
+	
+	if (timing.loops)
+	{
+		format_tag_seconds(length, size, timing.intro + timing.loop*auto_length_loops);
+		snprintf(fade, size, "%u", auto_length_fade);
+	}
+	else
+	{
+		format_tag_seconds(length, size, timing.intro + MP2K_SONG_END_TAIL);
+		snprintf(fade, size, "0");
+	}
+	return 1;
+}
+
+/* dir_depth is how many directories below the script the minigsf is */
+void make_minigsf_tag_data(buffer_t * tag_buf, unsigned dir_depth)
+{
+	char length[0x20];
+	char fade[0x20];
+	int is_auto_length = auto_length_loops && get_auto_length(length, fade, 0x20);
+	if (!is_auto_length && !dir_depth)
+	{
+		make_gsf_tag_data(tag_buf);
+		return;
+	}
+	
+	/* the tags set by the script stay for the next minigsf. they are
+		length, fade, and _lib with the overlay's _lib2 onwards */
+	unsigned count = 3 + overlay_lib_count;
+	char (*names)[0x10] = malloc(count * sizeof(*names));
+	char ** old_values = malloc(count * sizeof(char *));
+	strcpy(names[0], "length");
+	strcpy(names[1], "fade");
+	strcpy(names[2], "_lib");
+	for (unsigned i = 3; i < count; i++)
+		snprintf(names[i], 0x10, "_lib%u", i-1);
+	for (unsigned i = 0; i < count; i++)
+	{
+		char * value = get_gsf_tag_value(names[i]);
+		old_values[i] = value ? strdup(value) : NULL;
+	}
+	if (is_auto_length)
+	{
+		set_gsf_tag("length", length);
+		set_gsf_tag("fade", fade);
+	}
+	/* the gsflibs are beside the script, so a minigsf in a subdirectory
+		reaches them through its parents */
+	for (unsigned i = 2; i < count && dir_depth; i++)
+	{
+		if (!old_values[i])
+			continue;
+		size_t value_len = strlen(old_values[i]);
+		char * value = malloc(dir_depth*3 + value_len + 1);
+		for (unsigned j = 0; j < dir_depth; j++)
+			memcpy(value + j*3, "../", 3);
+		memcpy(value + dir_depth*3, old_values[i], value_len + 1);
+		set_gsf_tag(names[i], value);
+		free(value);
+	}
+	make_gsf_tag_data(tag_buf);
+	for (unsigned i = 0; i < count; i++)
+	{
+		set_gsf_tag(names[i], old_values[i]);
+		free(old_values[i]);
+	}
+	free(old_values);
+	free(names);
+}
+
+/* the paths of the minigsfs queued by this run, to catch two songs that
+	would write the same file */
+typedef struct {
+	char * path;
+	unsigned song_id;
+} written_name_t;
+
+written_name_t * written_names = NULL;
+size_t written_name_max = 0;  /* a power of 2 */
+size_t written_name_count = 0;
+
+/* filenames on Windows are case-insensitive, at least for ASCII */
+char fold_path_char(char ch)
+{
+#ifdef _WIN32
+	if (ch >= 'A' && ch <= 'Z')
+		return ch - 'A' + 'a';
+#endif
+	return ch;
+}
+
+size_t hash_path(const char * path)
+{
+	size_t hash = 0x811c9dc5;
+	for (; *path; path++)
+		hash = (hash ^ (uint8_t)fold_path_char(*path)) * 0x01000193;
+	return hash;
+}
+
+int is_same_path(const char * a, const char * b)
+{
+	for (; fold_path_char(*a) == fold_path_char(*b); a++, b++)
+	{
+		if (!*a)
+			return 1;
+	}
+	return 0;
+}
+
+/* returns the slot of the path, which is empty if it isn't in the set */
+written_name_t * find_written_name(const char * path)
+{
+	size_t i = hash_path(path) & (written_name_max-1);
+	while (written_names[i].path && !is_same_path(written_names[i].path, path))
+		i = (i+1) & (written_name_max-1);
+	return &written_names[i];
+}
+
+/* returns zero with the song ID that has the path if it was already added */
+int add_written_name(const char * path, unsigned id, unsigned * old_id)
+{
+	if ((written_name_count+1)*2 > written_name_max)
+	{ /* grow, keeping the table at most half full */
+		written_name_t * old_names = written_names;
+		size_t old_max = written_name_max;
+		written_name_max = old_max ? old_max*2 : 0x400;
+		written_names = calloc(written_name_max, sizeof(written_name_t));
+		for (size_t i = 0; i < old_max; i++)
+		{
+			if (old_names[i].path)
+				*find_written_name(old_names[i].path) = old_names[i];
+		}
+		free(old_names);
+	}
+	
+	written_name_t * name = find_written_name(path);
+	if (name->path)
+	{
+		*old_id = name->song_id;
+		return 0;
+	}
+	name->path = strdup(path);
+	name->song_id = id;
+	written_name_count++;
+	return 1;
+}
+
+/* queues the job writing a minigsf. takes ownership of the buffers */
+void queue_minigsf(char * filename, buffer_t * program_buf, buffer_t * patch_buf)
+{
+	char * path = make_script_path(filename, 1);
+	int is_written = path != NULL;
+	for (size_t i = 0; patch_buf && i < patch_buf->size; i += sizeof(minigsf_patch_t))
+		is_written &= ((minigsf_patch_t *)(patch_buf->data + i))->filename != NULL;
+	size_t program_start = read32(program_buf->data+4);
+	if (is_under_overlay(program_start, program_start + read32(program_buf->data+8)))
+	{
+		err("%s would have its song ID at $%08zX overwritten by the overlay, not written",filename,program_start);
+		is_written = 0;
+	}
+	unsigned old_id;
+	if (is_written && !add_written_name(path, song_id, &old_id))
+	{
+		err("%s is already the .minigsf of song ID %u, not overwritten",filename,old_id);
+		is_written = 0;
+	}
+	if (active_gsflib_state && active_gsflib_state->pending_job)
+	{
+		init_new_buffer(&active_gsflib_state->used_id_buf, 0x100*sizeof(unsigned));
+		append_buffer(&active_gsflib_state->used_id_buf, &song_id, sizeof(song_id));
+	}
+	if (is_written)
+		is_written = is_shard_output();
+	if (!is_written)
+	{
+		free(path);
+		free_buffer(program_buf);
+		for (size_t i = 0; patch_buf && i < patch_buf->size; i += sizeof(minigsf_patch_t))
+		{
+			minigsf_patch_t * patch = patch_buf->data + i;
+			free_buffer(&patch->program_buf);
+			free(patch->filename);
+			free(patch->display_name);
+		}
+		if (patch_buf)
+			free_buffer(patch_buf);
+		return;
+	}
+	
+	minigsf_job_t * mini = malloc(sizeof(*mini));
+	mini->filename = path;
+	mini->display_name = strdup(filename);
+	mini->program_buf = *program_buf;
+	mini->patch_buf = patch_buf ? *patch_buf : (buffer_t)DEFAULT_BUFFER_T;
+	mini->tag_buf = (buffer_t)DEFAULT_BUFFER_T;
+	unsigned dir_depth = 0;
+	for (char * p = filename; *p; p++)
+		dir_depth += *p == '/';
+	make_minigsf_tag_data(&mini->tag_buf, dir_depth);
+	mini->lib_state = active_gsflib_state;
+	mini->overlay_state = active_overlay_state;
+	
+	/* the buffers are already made, but reserving them holds back the
+		script until there's room */
+	size_t memory = mini->program_buf.max + mini->tag_buf.max + get_compress_memory(mini->program_buf.size);
+	for (size_t i = 0; i < mini->patch_buf.size; i += sizeof(minigsf_patch_t))
+	{
+		minigsf_patch_t * patch = mini->patch_buf.data + i;
+		memory += patch->program_buf.max;
+	}
+	submit_job(&mini->job, run_minigsf_job, memory);
+}
+
+void make_minigsf()
+{
+	char * filename = make_minigsf_filename();
+	if (!filename)
+		return;
+	
+	/** save minigsf data **/
+	if (is_gsflib_failed(active_gsflib_state) || is_gsflib_failed(active_overlay_state))
+	{ /* already reported, and the minigsf wouldn't work */
+		song_number++;
+		return;
+	}
+	buffer_t program_buf = DEFAULT_BUFFER_T;
+	init_buffer(&program_buf, 0x10);
+	write32(program_buf.data+0, entry_point);
+	write32(program_buf.data+4, minigsf_offset);
+	write32(program_buf.data+8, 4);
+	write32(program_buf.data+0xc, song_id);
+	program_buf.size = 0x10;
+	queue_minigsf(filename, &program_buf, NULL);
+	
+	song_number++;
+}
+
+int compare_diff_spans(const void * a, const void * b)
+{
+	const diff_span_t * span_a = a;
+	const diff_span_t * span_b = b;
+	return (span_a->start > span_b->start) - (span_a->start < span_b->start);
+}
+
+/* fills a program with a span of the patched ROM, as a player would see it
+	after loading the gsflib and its overlay */
+void make_patch_program(buffer_t * program_buf, diff_span_t * span, uint8_t * patched_rom, size_t patched_size)
+{
+	size_t size = span->end - span->start;
+	init_buffer(program_buf, 0xc + size);
+	write32(program_buf->data+0, entry_point);
+	write32(program_buf->data+4, entry_point + span->start);
+	write32(program_buf->data+8, size);
+	program_buf->size = 0xc + size;
+	
+	uint8_t * data = program_buf->data + 0xc;
+	memset(data, 0, size);
+	gsflib_state_t * states[2] = {active_gsflib_state, active_overlay_state};
+	for (int i = 0; i < 2; i++)
+	{
+		if (!states[i])
+			continue;
+		uint8_t * lib_program = states[i]->program_buf.data;
+		size_t lib_start = read32(lib_program+4) - entry_point;
+		size_t lib_end = lib_start + read32(lib_program+8);
+		size_t copy_start = span->start > lib_start ? span->start : lib_start;
+		size_t copy_end = span->end < lib_end ? span->end : lib_end;
+		if (copy_start < copy_end)
+			memcpy(data + copy_start - span->start, lib_program + 0xc + copy_start - lib_start, copy_end - copy_start);
+	}
+	size_t copy_end = span->end < patched_size ? span->end : patched_size;
+	if (span->start < copy_end)
+		memcpy(data, patched_rom + span->start, copy_end - span->start);
+}
+
+/* makes a minigsf that also carries the differences of a patched ROM from
+	the active gsflib (and overlay) ROM */
+void make_minigsf_patch(char * patch_name)
+{
+	gsflib_state_t * base_state = active_gsflib_state;
+	if (!base_state || is_buffer_new(&base_state->program_buf))
+	{
+		err("Patches need a gsflib made by MakeGSFLib");
+		return;
+	}
+	if (base_state->pending_job)
+	{
+		err("Patches can't be made for a gsflib with unused songs blanked");
+		return;
+	}
+	if (minigsf_offset < entry_point)
+	{
+		err("Patches need the minigsf offset to be above the entry point");
+		return;
+	}
+	
+	buffer_t patched_buf = DEFAULT_BUFFER_T;
+	if (!load_rom(patch_name, NULL, entry_point, &patched_buf))
+		return;
+	uint8_t * patched_rom = patched_buf.data + 0xc;
+	size_t patched_size = patched_buf.size - 0xc;
+	
+	/** find the differences, segment by segment of the loaded ROM **/
+	uint8_t * base_rom = base_state->program_buf.data + 0xc;
+	size_t base_size = base_state->program_buf.size - 0xc;
+	size_t overlay_start = base_size;
+	size_t overlay_end = base_size;
+	uint8_t * overlay_rom = NULL;
+	if (active_overlay_state)
+	{
+		overlay_rom = active_overlay_state->program_buf.data + 0xc;
+		overlay_start = read32(active_overlay_state->program_buf.data+4) - entry_point;
+		overlay_end = overlay_start + read32(active_overlay_state->program_buf.data+8);
+	}
+	size_t loaded_size = overlay_end > base_size ? overlay_end : base_size;
+	if (patched_size < loaded_size)
+		warn("%s is smaller than the gsflib ROM, the rest of the gsflib ROM will remain",patch_name);
+	
+	buffer_t span_buf = DEFAULT_BUFFER_T;
+	size_t common_size = patched_size < loaded_size ? patched_size : loaded_size;
+	size_t base_end = overlay_start < common_size ? overlay_start : common_size;
+	find_diff_spans(base_rom, patched_rom, 0, base_end, PATCH_MERGE_GAP, &span_buf);
+	if (overlay_rom && overlay_start < common_size)
+	{
+		size_t end = overlay_end < common_size ? overlay_end : common_size;
+		find_diff_spans(overlay_rom - overlay_start, patched_rom, overlay_start, end, PATCH_MERGE_GAP, &span_buf);
+		if (end < common_size)
+			find_diff_spans(base_rom, patched_rom, end, common_size, PATCH_MERGE_GAP, &span_buf);
+	}
+	if (patched_size > loaded_size)
+	{ /* past the end of the gsflib the player has zeroes */
+		uint8_t * zero = calloc(patched_size, 1);
+		find_diff_spans(zero, patched_rom, loaded_size, patched_size, PATCH_MERGE_GAP, &span_buf);
+		free(zero);
+	}
+	if (!span_buf.size)
+		warn("%s has no differences from the gsflib ROM",patch_name);
+	
+	/** merge the differences across segments, leaving out the song ID.
+		the minigsf's own program is loaded before the overlay and the
+		patches, so it only holds the song ID, and no patch may cover it **/
+	diff_span_t song_span = {minigsf_offset - entry_point, minigsf_offset - entry_point + 4};
+	if (span_buf.size)
+		qsort(span_buf.data, span_buf.size / sizeof(diff_span_t), sizeof(diff_span_t), compare_diff_spans);
+	buffer_t merged_buf = DEFAULT_BUFFER_T;
+	for (size_t i = 0; i < span_buf.size; i += sizeof(diff_span_t))
+	{
+		diff_span_t * span = span_buf.data + i;
+		add_diff_span(&merged_buf, span->start, span->end, PATCH_MERGE_GAP);
+	}
+	init_new_buffer(&span_buf, 0x10*sizeof(diff_span_t));
+	span_buf.size = 0;
+	for (size_t i = 0; i < merged_buf.size; i += sizeof(diff_span_t))
+	{
+		diff_span_t span = *(diff_span_t *)(merged_buf.data + i);
+		diff_span_t after = {song_span.end, span.end};
+		if (span.start < song_span.end && span.end > song_span.start)
+		{
+			span.end = song_span.start;
+			if (after.start < after.end)
+				append_buffer(&span_buf, &after, sizeof(after));
+		}
+		if (span.start < span.end)
+			append_buffer(&span_buf, &span, sizeof(span));
+	}
+	free_buffer(&merged_buf);
+	if (span_buf.size)
+		qsort(span_buf.data, span_buf.size / sizeof(diff_span_t), sizeof(diff_span_t), compare_diff_spans);
+	
+	/** build the minigsf and the files of the far-away spans **/
+	char * filename = make_minigsf_filename();
+	if (!filename || is_gsflib_failed(active_gsflib_state) || is_gsflib_failed(active_overlay_state))
+	{
+		if (filename)
+			song_number++;
+		free_buffer(&span_buf);
+		free_rom_buffer(&patched_buf);
+		return;
+	}
+	size_t filename_len = strlen(filename);
+	char * slash = strrchr(filename, '/');
+	char * ext = strrchr(slash ? slash : filename, '.');
+	size_t stem_len = ext ? (size_t)(ext - filename) : filename_len;
+	
+	buffer_t program_buf = DEFAULT_BUFFER_T;
+	init_buffer(&program_buf, 0x10);
+	write32(program_buf.data+0, entry_point);
+	write32(program_buf.data+4, minigsf_offset);
+	write32(program_buf.data+8, 4);
+	write32(program_buf.data+0xc, song_id);
+	program_buf.size = 0x10;
+	
+	/* the patches come after the overlay's files, so they win over them */
+	buffer_t patch_buf = DEFAULT_BUFFER_T;
+	init_buffer(&patch_buf, 0x10*sizeof(minigsf_patch_t));
+	unsigned lib_index = 2 + overlay_lib_count;
+	unsigned first_lib_index = lib_index;
+	for (size_t i = 0; i < span_buf.size; i += sizeof(diff_span_t))
+	{
+		diff_span_t * span = span_buf.data + i;
+		minigsf_patch_t patch;
+		size_t name_size = stem_len + 0x20;
+		patch.display_name = malloc(name_size);
+		snprintf(patch.display_name, name_size, "%.*s.patch%u.gsflib", (int)stem_len, filename, lib_index-first_lib_index+1);
+		patch.filename = make_script_path(patch.display_name, 1);
+		make_patch_program(&patch.program_buf, span, patched_rom, patched_size);
+		append_buffer(&patch_buf, &patch, sizeof(patch));
+		
+		char tag_name[0x10];
+		snprintf(tag_name, 0x10, "_lib%u", lib_index++);
+		/* the patches are beside the minigsf */
+		char * part_name = strrchr(patch.display_name, '/');
+		set_gsf_tag(tag_name, part_name ? part_name + 1 : patch.display_name);
+	}
+	free_buffer(&span_buf);
+	free_rom_buffer(&patched_buf);
+	
+	queue_minigsf(filename, &program_buf, &patch_buf);
+	
+	/* the patch tags only belong to this minigsf */
+	for (unsigned i = first_lib_index; i < lib_index; i++)
+	{
+		char tag_name[0x10];
+		snprintf(tag_name, 0x10, "_lib%u", i);
+		set_gsf_tag(tag_name, NULL);
+	}
+	
+	song_number++;
+}
+
+
+
+
+/* with ProbeSongs on, a range only makes minigsfs for the IDs that play a
+	song with notes, and only for the first ID of each song. songs with
+	identical headers play identically, even if the headers are copies */
+typedef struct {
+	size_t header;
+	size_t header_size;
+	unsigned first_id;
+	buffer_t id_buf;  /* the other IDs playing it */
+} song_group_t;
+
+void make_minigsf_range_probed(unsigned start, unsigned end, unsigned step)
+{
+	gsflib_state_t * state = active_gsflib_state;
+	if (!state || is_buffer_new(&state->program_buf))
+	{
+		err("ProbeSongs needs a gsflib made by MakeGSFLib");
+		return;
+	}
+	song_table_rom_t rom;
+	size_t table = get_gsflib_song_table(state, &rom);
+	if (table == (size_t)-1)
+	{
+		err("ProbeSongs can't find a song table");
+		return;
+	}
+	size_t count = count_song_table_entries(&rom, table);
+	
+	buffer_t group_buf = DEFAULT_BUFFER_T;
+	init_buffer(&group_buf, 0x100*sizeof(song_group_t));
+	size_t probed = 0;
+	size_t silent = 0;
+	size_t made = 0;
+	for (song_id = start; song_id <= end; song_id += step)
+	{
+		probed++;
+		song_timing_t timing;
+		if (song_id >= count || !get_mp2k_song_timing(&rom, table, song_id, 1, &timing, NULL) || !timing.has_notes)
+		{
+			silent++;
+		}
+		else
+		{
+			size_t header = read32(rom.data + table + (size_t)song_id*8) - rom.address;
+			size_t header_size = 8 + rom.data[header]*4;
+			song_group_t * groups = group_buf.data;
+			size_t i;
+			for (i = 0; i < group_buf.size / sizeof(song_group_t); i++)
+			{
+				if (groups[i].header_size == header_size && !memcmp(rom.data + groups[i].header, rom.data + header, header_size))
+					break;
+			}
+			if (i < group_buf.size / sizeof(song_group_t))
+			{
+				init_new_buffer(&groups[i].id_buf, 0x10*sizeof(unsigned));
+				append_buffer(&groups[i].id_buf, &song_id, sizeof(song_id));
+			}
+			else
+			{
+				song_group_t group = {header, header_size, song_id, DEFAULT_BUFFER_T};
+				append_buffer(&group_buf, &group, sizeof(group));
+				make_minigsf();
+				made++;
+			}
+		}
+		if (end - song_id < step)
+			break;
+	}
+	
+	for (size_t i = 0; i < group_buf.size; i += sizeof(song_group_t))
+	{
+		song_group_t * group = group_buf.data + i;
+		if (is_buffer_new(&group->id_buf))
+			continue;
+		
+		char text[0x200];
+		size_t len = snprintf(text, sizeof(text), "Song ID %u also plays as", group->first_id);
+		unsigned * ids = group->id_buf.data;
+		for (size_t j = 0; j < group->id_buf.size / sizeof(unsigned) && len < sizeof(text); j++)
+			len += snprintf(text+len, sizeof(text)-len, " %u", ids[j]);
+		warn("%s",text);
+		free_buffer(&group->id_buf);
+	}
+	free_buffer(&group_buf);
+	
+	warn("Probed %zu song IDs: made %zu .minigsfs, skipped %zu without notes and %zu repeats",
+		probed, made, silent, probed - made - silent);
+}
+
+/* makes a minigsf for every song in the song table of the active gsflib,
+	skipping entries that repeat an earlier song or have no tracks */
+void make_minigsf_song_table(unsigned table_address)
+{
+	gsflib_state_t * state = active_gsflib_state;
+	if (!state || is_buffer_new(&state->program_buf))
+	{
+		err("Song table scans need a gsflib made by MakeGSFLib");
+		return;
+	}
+	
+	song_table_rom_t rom;
+	size_t table = get_gsflib_song_table(state, &rom);
+	if (table_address)
+	{
+		if (!is_rom_pointer(&rom, table_address, 8))
+		{
+			err("Song table address $%08X is outside the ROM",table_address);
+			return;
+		}
+		table = table_address - rom.address;
+	}
+	else if (table == (size_t)-1)
+	{
+		err("Can't find a song table");
+		return;
+	}
+	
+	size_t count = count_song_table_entries(&rom, table);
+	buffer_t header_buf = DEFAULT_BUFFER_T;
+	init_buffer(&header_buf, 0x100*sizeof(unsigned));
+	size_t made = 0;
+	for (size_t i = 0; i < count; i++)
+	{
+		unsigned header = read32(rom.data + table + i*8);
+		unsigned * seen = header_buf.data;
+		size_t seen_count = header_buf.size / sizeof(unsigned);
+		size_t j;
+		for (j = 0; j < seen_count; j++)
+		{
+			if (seen[j] == header)
+				break;
+		}
+		if (j < seen_count)
+			continue;
+		append_buffer(&header_buf, &header, sizeof(header));
+		if (!get_song_table_entry_tracks(&rom, table + i*8))
+			continue;
+		
+		song_id = i;
+		make_minigsf();
+		made++;
+	}
+	free_buffer(&header_buf);
+	
+	warn("Song table at $%08X has %zu entries, made %zu .minigsfs",(unsigned)(rom.address + table),count,made);
+}
+
+/* ImportTracks reads a table of tracks, one row per .minigsf. the first row
+	names the columns: "id" for the song ID, and tag names for the rest. the
+	cells are separated by tabs if the first row has one, otherwise by
+	commas, and may be quoted CSV-style. the file is mapped and split in
+	place, only the cells themselves are copied */
+#define MAX_IMPORT_COLUMNS 0x40
+
+typedef struct {
+	const uint8_t * start;
+	const uint8_t * end;
+	int quoted;
+} import_cell_t;
+
+/* splits the row at p into cells and returns the start of the next row.
+	returns NULL with *error set and *count at the bad cell if the row is
+	malformed */
+const uint8_t * split_import_row(const uint8_t * p, const uint8_t * end, uint8_t delimiter, import_cell_t * cells, size_t * count, const char ** error)
+{
+	size_t n = 0;
+	*error = NULL;
+	while (1)
+	{
+		import_cell_t cell = {p, p, 0};
+		if (p < end && *p == '\"')
+		{
+			cell.quoted = 1;
+			cell.start = ++p;
+			while (1)
+			{
+				if (p >= end)
+				{
+					*error = "cell with no end quote";
+					*count = n+1;
+					return NULL;
+				}
+				if (*p == '\"')
+				{
+					if (p+1 < end && p[1] == '\"')
+						p += 2;
+					else
+						break;
+				}
+				else
+					p++;
+			}
+			cell.end = p++;
+			if (p < end && *p == '\r')
+				p++;
+			if (p < end && *p != delimiter && *p != '\n')
+			{
+				*error = "text after the end quote";
+				*count = n+1;
+				return NULL;
+			}
+		}
+		else
+		{
+			while (p < end && *p != delimiter && *p != '\n')
+				p++;
+			cell.end = p;
+			if (cell.end > cell.start && cell.end[-1] == '\r')
+				cell.end--;
+		}
+		
+		if (n < MAX_IMPORT_COLUMNS)
+			cells[n] = cell;
+		n++;
+		if (p >= end || *p == '\n')
+			break;
+		p++;
+	}
+	*count = n;
+	return p < end ? p+1 : end;
+}
+
+/* copies a cell into out_buf without its quotes. returns zero if it isn't
+	valid UTF-8 */
+int decode_import_cell(import_cell_t * cell, buffer_t * out_buf)
+{
+	init_new_buffer(out_buf, 0x100);
+	out_buf->size = 0;
+	const char * start = (const char *)cell->start;
+	size_t size = cell->end - cell->start;
+	if (get_valid_utf8_size(start, size) < size)
+		return 0;
+	if (!cell->quoted)
+	{
+		append_buffer(out_buf, start, size);
+	}
+	else
+	{
+		for (size_t i = 0; i < size; i++)
+		{
+			append_buffer_char(out_buf, start[i]);
+			if (start[i] == '\"')  /* doubled quote */
+				i++;
+		}
+	}
+	append_buffer_char(out_buf, '\0');
+	return 1;
+}
+
+/* parses a song ID like a script number. returns zero if it isn't one */
+int parse_import_id(import_cell_t * cell, unsigned * out)
+{
+	const uint8_t * p = cell->start;
+	const uint8_t * end = cell->end;
+	while (p < end && (*p == ' ' || *p == '\t'))
+		p++;
+	while (end > p && (end[-1] == ' ' || end[-1] == '\t'))
+		end--;
+	
+	unsigned base = 10;
+	if (p < end && *p == '$')
+	{
+		base = 16;
+		p++;
+	}
+	else if (end-p > 2 && p[0] == '0' && p[1] == 'x')
+	{
+		base = 16;
+		p += 2;
+	}
+	if (p == end)
+		return 0;
+	unsigned value = 0;
+	for (; p < end; p++)
+	{
+		unsigned digit;
+		if (isdigit(*p))
+			digit = *p - '0';
+		else if (base == 16 && isxdigit(*p))
+			digit = tolower(*p) - 'a' + 10;
+		else
+			return 0;
+		value = value*base + digit;
+	}
+	*out = value;
+	return 1;
+}
+
+void import_tracks(char * table_name)
+{
+	if (!get_gsf_tag("_lib"))
+	{
+		err("gsflib filename not defined yet");
+		return;
+	}
+	if (filename_template_error)
+		return;
+	if (is_buffer_new(&filename_op_buf))
+	{
+		err("Filename template not defined yet");
+		return;
+	}
+	
+	char * path = make_script_path(table_name, 0);
+	if (!path)
+		return;
+	size_t size;
+	const uint8_t * data = map_file(path, &size);
+	free(path);
+	if (!data)
+	{
+		err("Can't open %s: %s",table_name,strerror(errno));
+		return;
+	}
+	const uint8_t * p = data;
+	const uint8_t * end = data + size;
+	if (size >= 3 && !memcmp(p,"\xef\xbb\xbf",3))  /* UTF-8 BOM */
+		p += 3;
+	
+	/** the first row names the columns **/
+	const uint8_t * header_end = memchr(p, '\n', end-p);
+	if (!header_end)
+		header_end = end;
+	uint8_t delimiter = memchr(p, '\t', header_end-p) ? '\t' : ',';
+	import_cell_t cells[MAX_IMPORT_COLUMNS];
+	char * column_names[MAX_IMPORT_COLUMNS];
+	size_t column_count = 0;
+	size_t id_column = (size_t)-1;
+	size_t row = 1;
+	size_t made = 0;
+	buffer_t cell_buf = DEFAULT_BUFFER_T;
+	buffer_t row_buf = DEFAULT_BUFFER_T;  /* a row's decoded cells, one after another */
+	size_t cell_offsets[MAX_IMPORT_COLUMNS];
+	const char * error;
+	p = split_import_row(p, end, delimiter, cells, &column_count, &error);
+	if (!p)
+	{
+		err("%s row 1, column %zu: %s",table_name,column_count,error);
+		column_count = 0;
+		goto done;
+	}
+	if (column_count > MAX_IMPORT_COLUMNS)
+	{
+		err("%s has more than %u columns",table_name,MAX_IMPORT_COLUMNS);
+		column_count = 0;
+		goto done;
+	}
+	int header_ok = 1;
+	for (size_t i = 0; i < column_count; i++)
+	{
+		column_names[i] = NULL;
+		if (!decode_import_cell(&cells[i], &cell_buf))
+		{
+			err("%s row 1, column %zu: invalid UTF-8",table_name,i+1);
+			header_ok = 0;
+			continue;
+		}
+		if (!utf8_casecmp(cell_buf.data, "id"))
+		{
+			id_column = i;
+			continue;
+		}
+		/* "date" is the same as the Date command */
+		char * name = strdup(utf8_casecmp(cell_buf.data, "date") ? (char *)cell_buf.data : "year");
+		column_names[i] = name;
+		if (!gsf_tag_name_ok(name))
+		{
+			err("%s row 1, column %zu: bad tag name",table_name,i+1);
+			header_ok = 0;
+			continue;
+		}
+		for (size_t j = 0; j < i; j++)
+		{
+			if (column_names[j] && !strcmp(column_names[j], name))
+			{
+				err("%s row 1, column %zu: tag %s is already in column %zu",table_name,i+1,name,j+1);
+				header_ok = 0;
+			}
+		}
+	}
+	if (id_column == (size_t)-1)
+	{
+		err("%s has no id column",table_name);
+		header_ok = 0;
+	}
+	if (!header_ok)
+		goto done;
+	
+	/** every other row is a minigsf **/
+	while (p < end)
+	{
+		row++;
+		size_t count;
+		p = split_import_row(p, end, delimiter, cells, &count, &error);
+		if (!p)
+		{ /* the rest of the table can't be split reliably */
+			err("%s row %zu, column %zu: %s",table_name,row,count,error);
+			break;
+		}
+		if (count == 1 && cells[0].start == cells[0].end)  /* blank line */
+			continue;
+		if (count != column_count)
+		{
+			err("%s row %zu: %zu cells, expected %zu",table_name,row,count,column_count);
+			continue;
+		}
+		
+		unsigned id;
+		if (!parse_import_id(&cells[id_column], &id))
+		{
+			err("%s row %zu, column %zu: invalid song ID",table_name,row,id_column+1);
+			continue;
+		}
+		/* the whole row is decoded before any tag is set, so a bad row
+			leaves nothing behind for the rows after it */
+		init_new_buffer(&row_buf, 0x400);
+		row_buf.size = 0;
+		size_t i;
+		for (i = 0; i < column_count; i++)
+		{
+			if (i == id_column)
+				continue;
+			if (!decode_import_cell(&cells[i], &cell_buf))
+			{
+				err("%s row %zu, column %zu: invalid UTF-8",table_name,row,i+1);
+				break;
+			}
+			cell_offsets[i] = row_buf.size;
+			append_buffer(&row_buf, cell_buf.data, cell_buf.size);
+		}
+		if (i < column_count)
+			continue;
+		for (i = 0; i < column_count; i++)
+		{
+			if (i != id_column)
+				set_gsf_tag(column_names[i], (char *)row_buf.data + cell_offsets[i]);
+		}
+		
+		song_id = id;
+		make_minigsf();
+		made++;
+	}
+	warn("Imported %zu tracks from %s",made,table_name);
+	
+	done:
+	for (size_t i = 0; i < column_count; i++)
+		free(column_names[i]);
+	free_buffer(&cell_buf);
+	free_buffer(&row_buf);
+	unmap_file((void *)data, size);
+}
+
+
+
+
+
+
+
+
+/************************ Verifier *****************************/
+
+/* --verify checks a finished set of files without a player. every .gsflib,
+	.minigsf and .gsf under the given paths is mapped into memory and checked
+	on the thread pool, then the _lib references between them are
+	resolved. --recompress uses the same list of files */
+#define VERIFY_MAX_PROGRAM_SIZE (0x2000000 + 0xc)
+
+typedef struct {
+	char * path;
+	size_t size;
+	int is_lib;
+	int broken;
+	int referenced;
+	unsigned program_start;  /* the addresses its program is loaded to */
+	unsigned program_end;
+	buffer_t lib_buf;  /* verify_lib_t, the files named by its _lib tags */
+} verify_file_t;
+
+typedef struct {
+	char * path;
+	unsigned number;  /* 1 for _lib, 2 for _lib2... */
+} verify_lib_t;
+
+typedef struct {
+	job_t job;
+	verify_file_t * file;
+} verify_job_t;
+
+buffer_t verify_file_buf = DEFAULT_BUFFER_T;
+
+/* removes "." and "dir/.." parts and doubled slashes, so that paths to the
+	same file compare equal */
+void normalize_path(char * path)
+{
+	char * start = path[0] == '/' ? path+1 : path;
+	char * out = start;
+	char * in = start;
+	while (*in)
+	{
+		char * end = strchr(in, '/');
+		size_t len = end ? (size_t)(end - in) : strlen(in);
+		int is_dot = len == 1 && in[0] == '.';
+		int is_dot_dot = len == 2 && in[0] == '.' && in[1] == '.';
+		/* ".." goes back over the last part, unless that is ".." too */
+		int last_is_dot_dot = out - start >= 2 && out[-1] == '.' && out[-2] == '.' && (out - start == 2 || out[-3] == '/');
+		if (is_dot_dot && out > start && !last_is_dot_dot)
+		{
+			while (out > start && out[-1] != '/')
+				out--;
+			if (out > start)
+				out--;
+		}
+		else if (len && !is_dot)
+		{ /* the output is always behind the input, so this is safe */
+			if (out > start)
+				*out++ = '/';
+			memmove(out, in, len);
+			out += len;
+		}
+		in += len;
+		if (*in)
+			in++;
+	}
+	*out = '\0';
+}
+
+int has_extension(const char * path, const char * ext)
+{
+	size_t path_len = strlen(path);
+	size_t ext_len = strlen(ext);
+	if (path_len < ext_len)
+		return 0;
+	for (size_t i = 0; i < ext_len; i++)
+	{
+		if (tolower((unsigned char)path[path_len-ext_len+i]) != ext[i])
+			return 0;
+	}
+	return 1;
+}
+
+void find_gsf_files(const char * path)
+{
+	struct stat st;
+	if (stat(path, &st))
+	{
+		err("Can't find %s (%s)",path,strerror(errno));
+		return;
+	}
+	
+	if (S_ISDIR(st.st_mode))
+	{
+		DIR * dir = opendir(path);
+		if (!dir)
+		{
+			err("Can't open directory %s (%s)",path,strerror(errno));
+			return;
+		}
+		struct dirent * entry;
+		while ((entry = readdir(dir)))
+		{
+			if (!strcmp(entry->d_name,".") || !strcmp(entry->d_name,".."))
+				continue;
+			char * sub_path = malloc(strlen(path) + strlen(entry->d_name) + 2);
+			sprintf(sub_path, "%s/%s", path, entry->d_name);
+			find_gsf_files(sub_path);
+			free(sub_path);
+		}
+		closedir(dir);
+	}
+	else if (has_extension(path,".gsflib") || has_extension(path,".minigsf") || has_extension(path,".gsf"))
+	{
+		verify_file_t file = {strdup(path), st.st_size, has_extension(path,".gsflib"), 0, 0, 0, 0, DEFAULT_BUFFER_T};
+		normalize_path(file.path);
+		init_new_buffer(&verify_file_buf, 0x100*sizeof(verify_file_t));
+		append_buffer(&verify_file_buf, &file, sizeof(file));
+	}
+}
+
+/* checks the header of a decompressed program. returns nonzero if it's
+	valid */
+int check_program_header(verify_file_t * file, buffer_t * program_buf)
+{
+	if (program_buf->size < 0xc)
+	{
+		err("%s: program is too small",file->path);
+		return 0;
+	}
+	uint8_t * header = program_buf->data;
+	unsigned entry = read32(header);
+	unsigned offset = read32(header+4);
+	unsigned rom_size = read32(header+8);
+	if (entry != 0x2000000 && entry != 0x8000000)
+	{
+		err("%s: invalid entry point $%08X",file->path,entry);
+		return 0;
+	}
+	/* the spec asks for the same high byte, but the ROM region goes on
+		through $09FFFFFF, where minigsfs often put their song ID */
+	size_t region_size = entry == 0x8000000 ? 0x2000000 : 0x40000;
+	if (offset < entry || offset - entry > region_size || rom_size > region_size - (offset - entry))
+	{
+		err("%s: data at $%08X-$%08X is outside the entry point's region",file->path,offset,offset+rom_size);
+		return 0;
+	}
+	if (rom_size != program_buf->size - 0xc)
+	{
+		err("%s: ROM size $%X doesn't match the data size $%zX",file->path,rom_size,program_buf->size - 0xc);
+		return 0;
+	}
+	return 1;
+}
+
+/* checks a mapped gsf file. returns nonzero if it's valid */
+int check_mapped_gsf(verify_file_t * file, uint8_t * data, size_t size)
+{
+	if (size < 0x10 || memcmp(data,"PSF",3))
+	{
+		err("%s: not a PSF file",file->path);
+		return 0;
+	}
+	if (data[3] != 0x22)
+	{
+		err("%s: PSF version $%02X is not GSF",file->path,data[3]);
+		return 0;
+	}
+	size_t reserved_size = read32(data+4);
+	size_t program_size = read32(data+8);
+	if (reserved_size > size - 0x10 || program_size > size - 0x10 - reserved_size)
+	{
+		err("%s: sections are larger than the file",file->path);
+		return 0;
+	}
+	uint8_t * program = data + 0x10 + reserved_size;
+	if (get_program_crc32(program, program_size) != read32(data+0xc))
+	{
+		err("%s: CRC mismatch",file->path);
+		return 0;
+	}
+	
+	/** the program, inflated into a buffer of this check's own **/
+	if (program_size)
+	{
+		buffer_t program_buf = DEFAULT_BUFFER_T;
+		int ok = inflate_program(program, program_size, VERIFY_MAX_PROGRAM_SIZE, &program_buf);
+		if (!ok)
+			err("%s: program doesn't decompress",file->path);
+		else
+			ok = check_program_header(file, &program_buf);
+		if (ok)
+		{
+			file->program_start = read32(program_buf.data+4);
+			file->program_end = file->program_start + read32(program_buf.data+8);
+		}
+		free_buffer(&program_buf);
+		if (!ok)
+			return 0;
+	}
+	
+	/** the tags **/
+	uint8_t * tags = program + program_size;
+	size_t tags_size = size - (tags - data);
+	if (!tags_size)
+		return 1;
+	if (tags_size < 5 || memcmp(tags,"[TAG]",5))
+	{
+		warn("%s: unknown data after the program",file->path);
+		return 1;
+	}
+	int has_lib = 0;
+	for (size_t pos = 5; pos < tags_size; )
+	{
+		uint8_t * line = tags + pos;
+		uint8_t * line_end = memchr(line, '\n', tags_size - pos);
+		size_t len = line_end ? (size_t)(line_end - line) : tags_size - pos;
+		pos += len + 1;
+		while (len && line[len-1] <= ' ')
+			len--;
+		while (len && *line <= ' ')
+		{
+			line++;
+			len--;
+		}
+		if (!len)
+			continue;
+		uint8_t * eq = memchr(line, '=', len);
+		if (!eq)
+		{
+			warn("%s: tag line without '='",file->path);
+			continue;
+		}
+		size_t name_len = eq - line;
+		while (name_len && line[name_len-1] <= ' ')
+			name_len--;
+		if (name_len < 4 || memcmp(line,"_lib",4))
+			continue;
+		size_t digits = 4;
+		unsigned number = 0;
+		while (digits < name_len && isdigit(line[digits]) && number < 0x10000)
+			number = number*10 + line[digits++] - '0';
+		if (digits < name_len)
+			continue;
+		
+		uint8_t * value = eq + 1;
+		size_t value_len = len - (value - line);
+		while (value_len && *value <= ' ')
+		{
+			value++;
+			value_len--;
+		}
+		has_lib |= name_len == 4;
+		
+		/* library names are relative to the file's directory */
+		char * slash = strrchr(file->path, '/');
+		size_t dir_len = slash ? (size_t)(slash - file->path + 1) : 0;
+		char * lib_path = malloc(dir_len + value_len + 1);
+		memcpy(lib_path, file->path, dir_len);
+		memcpy(lib_path + dir_len, value, value_len);
+		lib_path[dir_len + value_len] = '\0';
+		for (char * c = lib_path + dir_len; *c; c++)
+			if (*c == '\\')
+				*c = '/';
+		normalize_path(lib_path);
+		verify_lib_t lib = {lib_path, number ? number : 1};
+		init_new_buffer(&file->lib_buf, 4*sizeof(verify_lib_t));
+		append_buffer(&file->lib_buf, &lib, sizeof(lib));
+	}
+	if (has_extension(file->path,".minigsf") && !has_lib)
+	{
+		err("%s: .minigsf without a _lib tag",file->path);
+		return 0;
+	}
+	return 1;
+}
+
+void run_verify_job(job_t * job)
+{
+	verify_file_t * file = ((verify_job_t *)job)->file;
+	size_t size;
+	uint8_t * data = map_file(file->path, &size);
+	if (!data)
+	{
+		err("%s: can't open (%s)",file->path,strerror(errno));
+		file->broken = 1;
+		return;
+	}
+	file->broken = !check_mapped_gsf(file, data, size);
+	unmap_file(data, size);
+}
+
+int compare_verify_files(const void * a, const void * b)
+{
+	return strcmp(((const verify_file_t *)a)->path, ((const verify_file_t *)b)->path);
+}
+
+void verify_paths(char ** paths, int count)
+{
+	for (int i = 0; i < count; i++)
+		find_gsf_files(paths[i]);
+	verify_file_t * files = verify_file_buf.data;
+	size_t file_count = verify_file_buf.size / sizeof(verify_file_t);
+	qsort(files, file_count, sizeof(*files), compare_verify_files);
+	
+	for (size_t i = 0; i < file_count; i++)
+	{
+		verify_job_t * job = malloc(sizeof(*job));
+		job->file = &files[i];
+		submit_job(&job->job, run_verify_job, files[i].size + get_inflate_memory(files[i].size));
+	}
+	wait_pool();
+	
+	/** resolve the library references **/
+	size_t broken = 0;
+	for (size_t i = 0; i < file_count; i++)
+	{
+		verify_file_t * file = &files[i];
+		verify_lib_t * libs = file->lib_buf.data;
+		for (size_t j = 0; j < file->lib_buf.size / sizeof(verify_lib_t); j++)
+		{
+			verify_file_t key = {libs[j].path, 0, 0, 0, 0, 0, 0, DEFAULT_BUFFER_T};
+			verify_file_t * lib = bsearch(&key, files, file_count, sizeof(*files), compare_verify_files);
+			struct stat st;
+			if (lib)
+			{
+				lib->referenced = 1;
+				if (lib->broken)
+				{
+					err("%s: uses broken %s",file->path,lib->path);
+					file->broken = 1;
+				}
+				/* _lib2 onwards are loaded after the file's own program */
+				else if (libs[j].number >= 2 && file->program_start < lib->program_end && file->program_end > lib->program_start)
+				{
+					err("%s: program at $%08X-$%08X is overwritten by %s",file->path,file->program_start,file->program_end-1,lib->path);
+					file->broken = 1;
+				}
+			}
+			else if (stat(libs[j].path, &st))
+			{
+				err("%s: missing %s",file->path,libs[j].path);
+				file->broken = 1;
+			}
+			free(libs[j].path);
+		}
+		free_buffer(&file->lib_buf);
+	}
+	
+	size_t orphaned = 0;
+	for (size_t i = 0; i < file_count; i++)
+	{
+		verify_file_t * file = &files[i];
+		if (file->is_lib && !file->referenced)
+		{
+			warn("%s: not used by any file",file->path);
+			orphaned++;
+		}
+		broken += file->broken;
+		free(file->path);
+	}
+	free_buffer(&verify_file_buf);
+	
+	warn("Verified %zu files: %zu broken, %zu orphaned",file_count,broken,orphaned);
+}
+
+
+
+
+
+
+
+
+/************************ Recompressor *****************************/
+
+/* --recompress shrinks existing files by compressing their programs again
+	at the highest setting. the reserved section and the tags are copied
+	as they are, and a file is only replaced, through a temporary file, if it
+	gets smaller */
+pthread_mutex_t recompress_mutex = PTHREAD_MUTEX_INITIALIZER;
+size_t recompressed_count = 0;
+size_t recompress_saved = 0;
+int recompress_level = BEST_COMPRESSION_LEVEL;
+
+/* renames a file over another, which is atomic where the OS allows it */
+int replace_file(const char * temp_path, const char * path)
+{
+#ifdef _WIN32
+	return MoveFileExA(temp_path, path, MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+	return !rename(temp_path, path);
+#endif
+}
+
+void run_recompress_job(job_t * job)
+{
+	verify_file_t * file = ((verify_job_t *)job)->file;
+	size_t size;
+	uint8_t * data = map_file(file->path, &size);
+	if (!data)
+	{
+		err("%s: can't open (%s)",file->path,strerror(errno));
+		return;
+	}
+	
+	buffer_t program_buf = DEFAULT_BUFFER_T;
+	buffer_t out_buf = DEFAULT_BUFFER_T;
+	char * temp_path = NULL;
+	size_t reserved_size = size >= 0x10 ? read32(data+4) : 0;
+	size_t program_size = size >= 0x10 ? read32(data+8) : 0;
+	if (size < 0x10 || memcmp(data,"PSF\x22",4) || reserved_size > size - 0x10 || program_size > size - 0x10 - reserved_size)
+	{
+		err("%s: not a valid GSF file",file->path);
+		goto done;
+	}
+	uint8_t * program = data + 0x10 + reserved_size;
+	if (get_program_crc32(program, program_size) != read32(data+0xc))
+	{
+		err("%s: CRC mismatch",file->path);
+		goto done;
+	}
+	if (!program_size)
+		goto done;
+	if (!inflate_program(program, program_size, VERIFY_MAX_PROGRAM_SIZE, &program_buf))
+	{
+		err("%s: program doesn't decompress",file->path);
+		goto done;
+	}
+	if (!compress_program_best(program_buf.data, program_buf.size, recompress_level, &out_buf) || out_buf.size >= program_size)
+		goto done;
+	
+	/** write the new file next to the old one, then replace it **/
+	temp_path = malloc(strlen(file->path) + sizeof(".tmp"));
+	sprintf(temp_path, "%s.tmp", file->path);
+	FILE * f = fopen(temp_path, "wb");
+	if (!f)
+	{
+		err("%s: can't write %s (%s)",file->path,temp_path,strerror(errno));
+		goto done;
+	}
+	uint8_t header[0x10];
+	memcpy(header, data, 8);
+	write32(header+8, out_buf.size);
+	write32(header+0xc, get_program_crc32(out_buf.data, out_buf.size));
+	fwrite(header,1,0x10,f);
+	fwrite(data+0x10,1,reserved_size,f);
+	fwrite(out_buf.data,1,out_buf.size,f);
+	fwrite(program+program_size,1,size-(program+program_size-data),f);
+	int ok = !ferror(f);
+	ok &= fclose(f) == 0;
+	
+	/* a mapped file can't be replaced on every OS */
+	unmap_file(data, size);
+	data = NULL;
+	if (ok)
+		ok = replace_file(temp_path, file->path);
+	if (!ok)
+	{
+		err("%s: error while writing (%s)",file->path,strerror(errno));
+		remove(temp_path);
+		goto done;
+	}
+	
+	pthread_mutex_lock(&recompress_mutex);
+	recompressed_count++;
+	recompress_saved += program_size - out_buf.size;
+	pthread_mutex_unlock(&recompress_mutex);
+	
+	done:
+	if (data)
+		unmap_file(data, size);
+	free(temp_path);
+	free_buffer(&program_buf);
+	free_buffer(&out_buf);
+}
+
+void recompress_paths(char ** paths, int count)
+{
+	for (int i = 0; i < count; i++)
+		find_gsf_files(paths[i]);
+	verify_file_t * files = verify_file_buf.data;
+	size_t file_count = verify_file_buf.size / sizeof(verify_file_t);
+	
+	for (size_t i = 0; i < file_count; i++)
+	{
+		verify_job_t * job = malloc(sizeof(*job));
+		job->file = &files[i];
+		size_t size = files[i].size;
+		submit_job(&job->job, run_recompress_job, size + get_inflate_memory(size) + get_compress_best_memory(size*GUESSED_DEFLATE_RATIO, recompress_level));
+	}
+	wait_pool();
+	
+	for (size_t i = 0; i < file_count; i++)
+		free(files[i].path);
+	free_buffer(&verify_file_buf);
+	
+	warn("Recompressed %zu of %zu files, saving %zu bytes",recompressed_count,file_count,recompress_saved);
+}
+
+
+
+
+
+
+
+
+/************************ Commands *****************************/
+
+/* every script command is described by an entry of script_commands. the
+	arguments are parsed and checked generically before the handler runs */
+#define MAX_COMMAND_ARGS 9
+#define COMMAND_HASH_SIZE 0x80  /* a power of 2 */
+
+typedef struct {
+	const char * name;
+	/* N = number, S = string. lowercase if optional, and everything after
+		an optional argument is optional too */
+	const char * arg_types;
+	const char * arg_names[MAX_COMMAND_ARGS];  /* of required arguments, for errors */
+	const char * arg_tags[MAX_COMMAND_ARGS];  /* string arguments setting a tag */
+	void (*run)(void);
+} command_t;
+
+/* the arguments of the command being run */
+struct {
+	const command_t * command;
+	int count;
+	intptr_t num[MAX_COMMAND_ARGS];
+	char * str[MAX_COMMAND_ARGS];
+} command_args;
+
+/************ gsflib-related ***************/
+void run_multiboot()
+{
+	entry_point = 0x2000000;
+}
+
+void run_make_gsflib()
+{
+	make_gsflib(command_args.str[0], command_args.str[1], command_args.count > 2 ? command_args.str[2] : NULL);
+	use_gsflib(command_args.str[1]);
+}
+
+void run_trim_rom()
+{
+	trim_rom_alignment = command_args.count ? command_args.num[0] : 4;
+}
+
+void run_gsflib_report()
+{
+	report_region_size = command_args.count ? command_args.num[0] : 0x10000;
+}
+
+void run_blank_unused_songs()
+{
+	blank_song_margin = command_args.count ? command_args.num[0] : 0x10;
+}
+
+void run_gsflib_cache()
+{
+	use_chunk_cache = command_args.count ? command_args.num[0] != 0 : 1;
+}
+
+void run_make_gsflib_overlay()
+{
+	make_gsflib_overlay(command_args.str[0], command_args.str[1], command_args.count > 2 ? command_args.str[2] : NULL);
+}
+
+void run_gsflib()
+{
+	use_gsflib(command_args.str[0]);
+}
+
+/************* tag-related *****************/
+void run_tag_command()
+{
+	/* a given value was set while parsing */
+	if (!command_args.count)
+		set_gsf_tag((char *)command_args.command->arg_tags[0], NULL);
+}
+
+void run_tag()
+{
+	if (command_args.count && gsf_tag_name_ok(command_args.str[0]))
+		set_gsf_tag(command_args.str[0], command_args.count > 1 ? command_args.str[1] : NULL);
+}
+
+/*************** minigsf-related **************/
+void run_filename_template()
+{
+	compile_filename_template(command_args.str[0]);
+}
+
+void run_minigsf_offset()
+{
+	minigsf_offset = command_args.num[0];
+}
+
+void run_set_song_number()
+{
+	song_number = command_args.num[0];
+}
+
+void run_make_minigsf()
+{
+	song_id = command_args.num[0];
+	make_minigsf();
+}
+
+void run_make_minigsf_patch()
+{
+	song_id = command_args.num[0];
+	make_minigsf_patch(command_args.str[1]);
+}
+
+void run_make_minigsf_range()
+{
+	unsigned start = command_args.num[0];
+	unsigned end = command_args.num[1];
+	unsigned step = command_args.count > 2 ? command_args.num[2] : 1;
+	if (step <= 0)
+		err("Invalid step value");
+	else if (probe_songs)
+		make_minigsf_range_probed(start, end, step);
+	else
+		for (song_id = start; song_id <= end; song_id += step)
+			make_minigsf();
+}
+
+void run_auto_length()
+{
+	auto_length_loops = command_args.count ? command_args.num[0] : 2;
+	if (command_args.count > 1)
+		auto_length_fade = command_args.num[1];
+}
+
+void run_probe_songs()
+{
+	probe_songs = command_args.count ? command_args.num[0] != 0 : 1;
+}
+
+void run_make_minigsf_song_table()
+{
+	make_minigsf_song_table(command_args.count ? command_args.num[0] : 0);
+}
+
+void run_import_tracks()
+{
+	import_tracks(command_args.str[0]);
+}
+
+#define TAG_COMMAND(name, tag) {name, "s", {NULL}, {tag}, run_tag_command}
+#define MINIGSF_TAG_ARGS "title", "artist", "comment", "length", "fade", "volume", "genre"
+
+const command_t script_commands[] = {
+	/************ gsflib-related ***************/
+	{"MultiBoot", "", {NULL}, {NULL}, run_multiboot},
+	{"MakeGSFLib", "SSs", {"source filename", "gsflib filename"}, {NULL}, run_make_gsflib},
+	{"TrimROM", "n", {NULL}, {NULL}, run_trim_rom},
+	{"GSFLibReport", "n", {NULL}, {NULL}, run_gsflib_report},
+	{"BlankUnusedSongs", "n", {NULL}, {NULL}, run_blank_unused_songs},
+	{"GSFLibCache", "n", {NULL}, {NULL}, run_gsflib_cache},
+	{"MakeGSFLibOverlay", "SSs", {"source filename", "overlay filename"}, {NULL}, run_make_gsflib_overlay},
+	{"GSFLib", "S", {"gsflib filename"}, {NULL}, run_gsflib},
+	/************* tag-related *****************/
+	TAG_COMMAND("Title", "title"),
+	TAG_COMMAND("Artist", "artist"),
+	TAG_COMMAND("Game", "game"),
+	TAG_COMMAND("Date", "year"),
+	TAG_COMMAND("Year", "year"),
+	TAG_COMMAND("Genre", "genre"),
+	TAG_COMMAND("Comment", "comment"),
+	TAG_COMMAND("Copyright", "copyright"),
+	TAG_COMMAND("GSFBy", "gsfby"),
+	TAG_COMMAND("Volume", "volume"),
+	TAG_COMMAND("Length", "length"),
+	TAG_COMMAND("Fade", "fade"),
+	{"Tag", "ss", {NULL}, {NULL}, run_tag},
+	/*************** minigsf-related **************/
+	{"FilenameTemplate", "S", {"filename template"}, {NULL}, run_filename_template},
+	{"MiniGSFOffset", "N", {"minigsf offset"}, {NULL}, run_minigsf_offset},
+	{"SetSongNumber", "N", {"song number"}, {NULL}, run_set_song_number},
+	{"MakeMiniGSF", "Nsssssss", {"song ID"}, {NULL, MINIGSF_TAG_ARGS}, run_make_minigsf},
+	{"MakeMiniGSFPatch", "NSsssssss", {"song ID", "patched ROM filename"}, {NULL, NULL, MINIGSF_TAG_ARGS}, run_make_minigsf_patch},
+	{"MakeMiniGSFRange", "NNn", {"range start", "range end"}, {NULL}, run_make_minigsf_range},
+	{"AutoLength", "nn", {NULL}, {NULL}, run_auto_length},
+	{"ProbeSongs", "n", {NULL}, {NULL}, run_probe_songs},
+	{"MakeMiniGSFSongTable", "n", {NULL}, {NULL}, run_make_minigsf_song_table},
+	{"ImportTracks", "S", {"track table filename"}, {NULL}, run_import_tracks},
+};
+#define SCRIPT_COMMAND_COUNT (sizeof(script_commands)/sizeof(*script_commands))
+
+/* the commands are looked up in a perfect hash table, with the seed picked
+	on startup so that no two command names collide */
+const command_t * command_hash[COMMAND_HASH_SIZE];
+unsigned command_hash_seed;
+
+unsigned hash_command_name(const char * name, unsigned seed)
+{
+	unsigned hash = seed;
+	while (*name)
+	{
+		unsigned ch = (uint8_t)*name;
+		size_t length = 1;
+		if (ch >= 0x80 && !(length = decode_utf8(name, SIZE_MAX, &ch)))
+			length = 1;
+		hash = (hash ^ towlower(ch)) * 0x01000193;
+		name += length;
+	}
+	return (hash ^ (hash >> 16)) & (COMMAND_HASH_SIZE-1);
+}
+
+void init_commands()
+{
+	for (command_hash_seed = 0x811c9dc5; ; command_hash_seed++)
+	{
+		memset(command_hash, 0, sizeof(command_hash));
+		size_t i;
+		for (i = 0; i < SCRIPT_COMMAND_COUNT; i++)
+		{
+			unsigned hash = hash_command_name(script_commands[i].name, command_hash_seed);
+			if (command_hash[hash])
+				break;
+			command_hash[hash] = &script_commands[i];
+		}
+		if (i == SCRIPT_COMMAND_COUNT)
+			break;
+	}
+}
+
+/* parses the arguments of the rest of the line into command_args.
+	returns zero if a required one is missing */
+int parse_command_args(const command_t * command)
+{
+	static buffer_t str_bufs[MAX_COMMAND_ARGS];
+	command_args.command = command;
+	command_args.count = 0;
+	for (int i = 0; command->arg_types[i]; i++)
+	{
+		char type = command->arg_types[i];
+		token_t * tok = parse_one_token_type(NULL, toupper(type) == 'N' ? TOK_NUM : TOK_STR);
+		if (!tok)
+		{
+			if (islower(type))
+				break;
+			err("Can't get %s value", command->arg_names[i]);
+			return 0;
+		}
+		if (tok->type == TOK_NUM)
+		{
+			command_args.num[i] = (intptr_t)tok->value;
+		}
+		else
+		{ /* the token's string is only valid until the next token */
+			set_buffer(&str_bufs[i], tok->value, strlen(tok->value)+1);
+			command_args.str[i] = str_bufs[i].data;
+		}
+		command_args.count++;
+	}
+	
+	for (int i = 0; i < command_args.count; i++)
+	{
+		if (command->arg_tags[i])
+			set_gsf_tag((char *)command->arg_tags[i], command_args.str[i]);
+	}
+	return 1;
+}
+
+/* runs the command of a script line, whose name was just parsed */
+void run_command(char * name)
+{
+	const command_t * command = command_hash[hash_command_name(name, command_hash_seed)];
+	if (!command || utf8_casecmp(command->name, name))
+	{
+		err("Unrecognized command %s",name);
+		return;
+	}
+	if (parse_command_args(command))
+		command->run();
+}
+
+
+
+
+
+
+
+
+/*************************** Main *****************************/
+
+/* every script starts from a clean state */
+void reset_script_state()
+{
+	entry_point = 0x8000000;
+	free_buffer(&filename_op_buf);
+	free_buffer(&filename_literal_buf);
+	filename_template_error = 0;
+	minigsf_offset = 0;
+	trim_rom_alignment = 0;
+	use_chunk_cache = 0;
+	report_region_size = 0;
+	blank_song_margin = 0;
+	auto_length_loops = 0;
+	auto_length_fade = 10;
+	probe_songs = 0;
+	song_number = 1;
+	song_id = 0;
+	for (size_t i = 0; i < gsf_tag_buf.size; i += sizeof(gsf_tag_t))
+	{
+		gsf_tag_t * tag = gsf_tag_buf.data + i;
+		free_buffer(&tag->name_buf);
+		free_buffer(&tag->value_buf);
+	}
+	free_buffer(&gsf_tag_buf);
+	for (size_t i = 0; i < gsflib_buf.size; i += sizeof(gsflib_t))
+	{
+		gsflib_t * lib = gsflib_buf.data + i;
+		free_buffer(&lib->name_buf);
+		release_gsflib_program(lib->state);
+	}
+	free_buffer(&gsflib_buf);
+	active_gsflib_state = NULL;
+	release_gsflib_program(active_overlay_state);
+	active_overlay_state = NULL;
+	overlay_lib_count = 0;
+	free_buffer(&overlay_span_buf);
+}
+
+void run_script(const char * src_filename)
+{
+	reset_script_state();
+	if (!open_script(src_filename))
+		return;
+	
+	while (1)
+	{
+		char * line = read_script_line();
 		if (!line)
 			break;
 		
 		token_t * cmd_tok = parse_one_token_type(line,TOK_ID);
 		if (cmd_tok)
+			run_command(cmd_tok->value);
+	}
+	
+	submit_blanked_gsflibs();
+	close_script();
+}
+
+/* a manifest lists one script per line, relative to the manifest itself */
+void run_manifest(const char * manifest_filename)
+{
+	FILE * f = fopen(manifest_filename,"r");
+	if (!f)
+	{
+		err("Can't open %s: %s", manifest_filename, strerror(errno));
+		return;
+	}
+	
+	size_t dir_len = 0;
+	for (size_t i = 0; manifest_filename[i]; i++)
+	{
+		if (manifest_filename[i] == '/' || manifest_filename[i] == '\\')
+			dir_len = i+1;
+	}
+	
+	buffer_t path_buf = DEFAULT_BUFFER_T;
+	init_buffer(&path_buf,0x200);
+	int end_flag = 0;
+	while (!end_flag)
+	{
+		path_buf.size = 0;
+		while (1)
 		{
-			wchar_t * n = cmd_tok->value;
-			/************ gsflib-related ***************/
-			if (!wcscasecmp(n,L"MultiBoot"))
-				entry_point = 0x2000000;
-			else if (!wcscasecmp(n,L"MakeGSFLib"))
-			{
-				token_t * tok = parse_one_token_type(NULL,TOK_STR);
-				if (tok)
-				{
-					wchar_t * inname = wcsdup(tok->value);
-					tok = parse_one_token_type(NULL,TOK_STR);
-					if (tok)
-					{
-						wchar_t * outname = tok->value;
-						make_gsflib(inname,outname);
-						set_gsf_tag(L"_lib", outname);
-					}
-					else
-					{
-						err("Can't get gsflib filename value");
-					}
-					free(inname);
-				}
-				else
-				{
-					err("Can't get source filename value");
-				}
-			}
-			else if (!wcscasecmp(n,L"GSFLib"))
-			{
-				if (!get_gsf_tag(L"_lib"))
-				{
-					token_t * name_tok = parse_one_token_type(NULL,TOK_STR);
-					if (name_tok)
-					{
-						wchar_t * value = name_tok->value;
-						set_gsf_tag(L"_lib", value);
-					}
-					else
-					{
-						err("Can't get gsflib filename value");
-					}
-				}
-				else
-				{
-					err("gsflib filename already defined");
-				}
-			}
-			/************* tag-related *****************/
-			else if (!wcscasecmp(n,L"Title"))
-				parse_set_gsf_tag(L"title");
-			else if (!wcscasecmp(n,L"Artist"))
-				parse_set_gsf_tag(L"artist");
-			else if (!wcscasecmp(n,L"Game"))
-				parse_set_gsf_tag(L"game");
-			else if (!wcscasecmp(n,L"Date"))
-				parse_set_gsf_tag(L"year");
-			else if (!wcscasecmp(n,L"Year"))
-				parse_set_gsf_tag(L"year");
-			else if (!wcscasecmp(n,L"Genre"))
-				parse_set_gsf_tag(L"genre");
-			else if (!wcscasecmp(n,L"Comment"))
-				parse_set_gsf_tag(L"comment");
-			else if (!wcscasecmp(n,L"Copyright"))
-				parse_set_gsf_tag(L"copyright");
-			else if (!wcscasecmp(n,L"GSFBy"))
-				parse_set_gsf_tag(L"gsfby");
-			else if (!wcscasecmp(n,L"Volume"))
-				parse_set_gsf_tag(L"volume");
-			else if (!wcscasecmp(n,L"Length"))
-				parse_set_gsf_tag(L"length");
-			else if (!wcscasecmp(n,L"Fade"))
-				parse_set_gsf_tag(L"fade");
-			else if (!wcscasecmp(n,L"Tag"))
-			{
-				token_t * name_tok = parse_one_token_type(NULL,TOK_STR);
-				if (name_tok)
-				{
-					wchar_t * name = wcsdup(name_tok->value);
-					if (gsf_tag_name_ok(name))
-						parse_set_gsf_tag(name);
-					free(name);
-				}
-			}
-			/*************** minigsf-related **************/
-			else if (!wcscasecmp(n,L"FilenameTemplate"))
-			{
-				token_t * template_tok = parse_one_token_type(NULL,TOK_STR);
-				if (template_tok)
-				{
-					wchar_t * value = template_tok->value;
-					set_buffer(&filename_template_buf,value,(wcslen(value)+1)*sizeof(wchar_t));
-				}
-				else
-				{
-					err("Can't get filename template value");
-				}
-			}
-			else if (!wcscasecmp(n,L"MiniGSFOffset"))
-			{
-				token_t * offset_tok = parse_one_token_type(NULL,TOK_NUM);
-				if (offset_tok)
-				{
-					minigsf_offset = (intptr_t)offset_tok->value;
-				}
-				else
-				{
-					err("Can't get minigsf offset value");
-				}
-			}
-			else if (!wcscasecmp(n,L"SetSongNumber"))
-			{
-				token_t * tok = parse_one_token_type(NULL,TOK_NUM);
-				if (tok)
-				{
-					song_number = (intptr_t)tok->value;
-				}
-				else
-				{
-					err("Can't get song number value");
-				}
-			}
-			else if (!wcscasecmp(n,L"MakeMiniGSF"))
+			int ch = fgetc(f);
+			if (ch == EOF)
 			{
-				token_t * id_tok = parse_one_token_type(NULL,TOK_NUM);
-				if (id_tok)
-				{
-					song_id = (intptr_t)id_tok->value;
-					if (parse_set_gsf_tag_optional(L"title"))
-						if (parse_set_gsf_tag_optional(L"artist"))
-							if (parse_set_gsf_tag_optional(L"comment"))
-								if (parse_set_gsf_tag_optional(L"length"))
-									if (parse_set_gsf_tag_optional(L"fade"))
-										if (parse_set_gsf_tag_optional(L"volume"))
-											if (parse_set_gsf_tag_optional(L"genre"))
-											{ }
-					make_minigsf();
-				}
-				else
-				{
-					err("Can't get song ID value");
-				}
+				end_flag = 1;
+				break;
 			}
-			else if (!wcscasecmp(n,L"MakeMiniGSFRange"))
+			if (ch == '\n')
+				break;
+			append_buffer_char(&path_buf,ch);
+		}
+		
+		/* trim whitespace, skip blank lines and comments */
+		char * path = path_buf.data;
+		while (path_buf.size && (unsigned char)path[path_buf.size-1] <= ' ')
+			path_buf.size--;
+		size_t start = 0;
+		while (start < path_buf.size && (unsigned char)path[start] <= ' ')
+			start++;
+		if (start == path_buf.size || path[start] == '#')
+			continue;
+		append_buffer_char(&path_buf,'\0');
+		path = path_buf.data;
+		
+		if (path[start] == '/' || path[start] == '\\' || (path[start] && path[start+1] == ':'))
+		{
+			run_script(path+start);
+		}
+		else
+		{
+			char * full_path = malloc(dir_len+strlen(path+start)+1);
+			memcpy(full_path, manifest_filename, dir_len);
+			strcpy(full_path+dir_len, path+start);
+			run_script(full_path);
+			free(full_path);
+		}
+	}
+	
+	free_buffer(&path_buf);
+	fclose(f);
+}
+
+/* parses a size like 512M or 2G for --max-memory. returns 0 if it's
+	invalid */
+size_t parse_memory_size(const char * str)
+{
+	char * end;
+	unsigned long long size = strtoull(str, &end, 10);
+	if (end == str)
+		return 0;
+	switch (toupper((uint8_t)*end))
+	{
+		case 'G':
+			size <<= 10;
+			/* fall through */
+		case 'M':
+			size <<= 10;
+			/* fall through */
+		case 'K':
+			size <<= 10;
+			end++;
+			break;
+	}
+	if (*end && strcmp(end, "B") && strcmp(end, "b"))
+		return 0;
+	return size <= SIZE_MAX ? size : 0;
+}
+
+void report_memory_use()
+{
+	double mib = 1 << 20;
+	size_t resident = get_peak_resident_memory();
+	if (resident)
+		printf("Peak memory: %.1f MiB reserved, %.1f MiB resident, of a %.1f MiB budget\n",
+			memory_reserved_peak / mib, resident / mib, max_memory / mib);
+	else
+		printf("Peak memory: %.1f MiB reserved, of a %.1f MiB budget\n",
+			memory_reserved_peak / mib, max_memory / mib);
+}
+
+int main(int argc, char *argv[])
+{
+	setlocale(LC_ALL,"");
+	init_commands();
+	
+	unsigned thread_count = 0;
+	int argi = 1;
+	while (argi < argc && argv[argi][0] == '-' && argv[argi][1])
+	{
+		if (!strcmp(argv[argi],"--verify"))
+		{
+			verify_mode = 1;
+			argi++;
+		}
+		else if (!strcmp(argv[argi],"--recompress"))
+		{
+			recompress_mode = 1;
+			argi++;
+		}
+		else if (!strcmp(argv[argi],"--level") && argi+1 < argc)
+		{
+			recompress_level = strtoul(argv[argi+1],NULL,10);
+			argi += 2;
+		}
+		else if (!strcmp(argv[argi],"--retag"))
+		{
+			retag_mode = 1;
+			argi++;
+		}
+		else if (!strcmp(argv[argi],"--max-memory") && argi+1 < argc)
+		{
+			max_memory = parse_memory_size(argv[argi+1]);
+			argi = max_memory ? argi+2 : argc;
+		}
+		else if (!strcmp(argv[argi],"--shard") && argi+1 < argc)
+		{
+			if (sscanf(argv[argi+1],"%u/%u",&shard_index,&shard_count) != 2 || !shard_index || shard_index > shard_count)
+				argi = argc;
+			else
 			{
-				unsigned start;
-				unsigned end;
-				unsigned step = 1;
-				
-				token_t * tok = parse_one_token_type(NULL,TOK_NUM);
-				if (tok)
-				{
-					start = (intptr_t)tok->value;
-					tok = parse_one_token_type(NULL,TOK_NUM);
-					if (tok)
-					{
-						end = (intptr_t)tok->value;
-						tok = parse_one_token_type(NULL,TOK_NUM);
-						if (tok)
-						{
-							step = (intptr_t)tok->value;
-						}
-						if (step <= 0)
-						{
-							err("Invalid step value");
-						}
-						else
-						{
-							for (song_id = start; song_id <= end; song_id += step)
-								make_minigsf();
-						}
-					}
-					else
-					{
-						err("Can't get range end value");
-					}
-				}
-				else
-				{
-					err("Can't get range start value");
-				}
+				shard_index--;
+				argi += 2;
 			}
-			/*************** invalid ****************/
-			else
-				werr(L"Unrecognized command %ls",n);
+		}
+		else if (!strcmp(argv[argi],"-j") && argi+1 < argc)
+		{
+			thread_count = strtoul(argv[argi+1],NULL,10);
+			argi += 2;
+		}
+		else if (!strncmp(argv[argi],"-j",2))
+		{
+			thread_count = strtoul(argv[argi]+2,NULL,10);
+			argi++;
+		}
+		else
+		{
+			argi = argc;
 		}
 	}
+	if (argi >= argc)
+	{
+		puts("usage: makegsf [-j threads] [--max-memory size] [--retag] [--shard K/N] scriptfile|@listfile...\n"
+			"       makegsf [-j threads] [--max-memory size] --verify path...\n"
+			"       makegsf [-j threads] [--max-memory size] --recompress [--level N] path...");
+		return EXIT_FAILURE;
+	}
+#ifdef _WIN32
+	sprintf(os_character_encoding, "CP%u", GetACP());
+	os_encoding_is_utf8 = GetACP() == CP_UTF8;
+#else
+	os_encoding_is_utf8 = !strcmp(nl_langinfo(CODESET), "UTF-8");
+#endif
 	
-	close_script();
+	start_pool(thread_count);
 	
+	if (verify_mode)
+		verify_paths(argv+argi, argc-argi);
+	else if (recompress_mode)
+		recompress_paths(argv+argi, argc-argi);
+	else for ( ; argi < argc; argi++)
+	{
+		if (argv[argi][0] == '@')
+			run_manifest(argv[argi]+1);
+		else
+			run_script(argv[argi]);
+	}
+	
+	stop_pool();
+	free_gsflib_states();
+	close_cached_dirs();
+	if (max_memory)
+		report_memory_use();
+	
+	if (error_count)
+	{
+		printf("%u error%s\n", error_count, error_count == 1 ? "" : "s");
+		return EXIT_FAILURE;
+	}
 	return EXIT_SUCCESS;
 }
\ No newline at end of file